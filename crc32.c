@@ -0,0 +1,201 @@
+/*
+ * Table driven CRC32 for JFFS2, using the slicing-by-8 method: eight
+ * input bytes are folded into the CRC per step, with one lookup table
+ * for each byte position. On x86 CPUs with PCLMULQDQ, longer buffers
+ * are folded with carry-less multiplication instead.
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. See jffs2extract.c for the full license.
+ */
+
+#include <string.h>
+
+#include "include/crc32.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define HAVE_PCLMUL 1
+#endif
+
+#define CRC32_POLY 0xedb88320
+
+static uint32_t crc32_table[8][256];
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t len);
+static uint32_t (*crc32_impl)(uint32_t, const unsigned char *, size_t) = crc32_slice8;
+
+#ifdef HAVE_PCLMUL
+
+/* folds 64 bytes per step with carry-less multiplication, then reduces
+   to 32 bits with a Barrett reduction, as described in Intel's "Fast
+   CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+   the constants are for the bit-reflected polynomial. len must be a
+   multiple of 16 and at least 64. */
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(uint32_t crc, const unsigned char *p, size_t len)
+{
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *) k1k2);
+	p += 64;
+	len -= 64;
+
+	/* four independent 128 bit lanes */
+	for (; len >= 64; p += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *) (p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				_mm_loadu_si128((const __m128i *) (p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				_mm_loadu_si128((const __m128i *) (p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				_mm_loadu_si128((const __m128i *) (p + 0x30)));
+	}
+
+	/* fold the lanes into one */
+	x0 = _mm_load_si128((const __m128i *) k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	for (; len >= 16; p += 16, len -= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *) p));
+	}
+
+	/* 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x0 = _mm_loadl_epi64((const __m128i *) k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *) poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	if (len >= 64) {
+		n = len & ~(size_t) 15;
+		crc = crc32_fold(crc, p, n);
+		p += n;
+		len -= n;
+	}
+
+	return crc32_slice8(crc, p, len);
+}
+
+#endif
+
+/* fills the lookup tables and picks the fastest implementation. must
+   be called before jffs2_crc32 */
+
+void crc32_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? CRC32_POLY : 0);
+		crc32_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32_table[j][i] = (crc32_table[j - 1][i] >> 8) ^
+				crc32_table[0][crc32_table[j - 1][i] & 0xff];
+
+#ifdef HAVE_PCLMUL
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+		crc32_impl = crc32_pclmul;
+#endif
+}
+
+/* table driven CRC32, eight bytes per step on little endian hosts */
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t a, b;
+
+	for (; len && ((uintptr_t) p & 7); len--)
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&a, p, 4);
+		memcpy(&b, p + 4, 4);
+		a ^= crc;
+		crc = crc32_table[7][a & 0xff] ^
+			crc32_table[6][(a >> 8) & 0xff] ^
+			crc32_table[5][(a >> 16) & 0xff] ^
+			crc32_table[4][a >> 24] ^
+			crc32_table[3][b & 0xff] ^
+			crc32_table[2][(b >> 8) & 0xff] ^
+			crc32_table[1][(b >> 16) & 0xff] ^
+			crc32_table[0][b >> 24];
+	}
+#endif
+
+	for (; len; len--)
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/* computes the CRC32 of a buffer the way JFFS2 does */
+
+/*
+   crc     - CRC of the preceding data, zero to start
+   buf     - data
+   len     - length of data
+
+   return value: updated CRC
+ */
+
+uint32_t jffs2_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32_impl(crc, buf, len);
+}
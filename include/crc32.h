@@ -0,0 +1,13 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* JFFS2 flavour of the IEEE 802.3 CRC32: reflected polynomial 0xedb88320,
+   no pre- or post-inversion */
+
+void crc32_init(void);
+uint32_t jffs2_crc32(uint32_t crc, const void *buf, size_t len);
+
+#endif /* CRC32_H */
@@ -0,0 +1,669 @@
+/*
+ * Byte order specialised node handling for jffs2extract.c.
+ *
+ * This file is included twice by jffs2extract.c, once with
+ * JFFS2_SWAPPED set to 0 for images in host byte order and once with 1
+ * for images in the other one. t16() and t32() are redefined for the
+ * duration, so every field access in the scan and decode loops compiles
+ * to a plain load or a load and byte swap, without looking at
+ * target_endian. Functions get a _native or _swapped suffix.
+ */
+
+#pragma push_macro("t16")
+#pragma push_macro("t32")
+#undef t16
+#undef t32
+
+#if JFFS2_SWAPPED
+#define t16(x) bswap_16((x))
+#define t32(x) bswap_32((x))
+#define SPECIALISE(name) name##_swapped
+#else
+#define t16(x) (x)
+#define t32(x) (x)
+#define SPECIALISE(name) name##_native
+#endif
+
+/* decodes the data of a file node. */
+
+/*
+   dc      - decoder
+   n       - node
+   b       - output buffer, at least dsize bytes
+
+   return value: 0 on success, -1 if the data could not be decoded
+ */
+
+static int SPECIALISE(decode_node)(struct decoder *dc, struct jffs2_raw_inode *n, char *b)
+{
+	uLongf dlen = je32_to_cpu(n->dsize);
+	lzo_uint llen;
+	uint64_t t0 = 0;
+	int ret = 0;
+
+	if (show_stats)
+		t0 = now_ns();
+
+	switch (n->compr) {
+		case JFFS2_COMPR_ZLIB:
+			if (zlib_inflate(dc, (Bytef *) b, &dlen,
+					(Bytef *) ((char *) n) + sizeof(struct jffs2_raw_inode),
+					(uLong) je32_to_cpu(n->csize)) != Z_OK ||
+					dlen != je32_to_cpu(n->dsize)) {
+				warnmsg("zlib decompression failed for inode %u version %u",
+						je32_to_cpu(n->ino), je32_to_cpu(n->version));
+				ret = -1;
+			}
+			break;
+
+		case JFFS2_COMPR_LZO:
+			llen = dlen;
+			if (lzo1x_decompress_safe(
+					(lzo_bytep) ((char *) n) + sizeof(struct jffs2_raw_inode),
+					je32_to_cpu(n->csize), (lzo_bytep) b, &llen,
+					NULL) != LZO_E_OK || llen != dlen) {
+				warnmsg("LZO decompression failed for inode %u version %u",
+						je32_to_cpu(n->ino), je32_to_cpu(n->version));
+				ret = -1;
+			}
+			break;
+
+		case JFFS2_COMPR_NONE:
+			if (je32_to_cpu(n->csize) < dlen) {
+				warnmsg("short uncompressed data in inode %u version %u",
+						je32_to_cpu(n->ino), je32_to_cpu(n->version));
+				ret = -1;
+				break;
+			}
+			memcpy(b, ((char *) n) + sizeof(struct jffs2_raw_inode), dlen);
+			break;
+
+		case JFFS2_COMPR_ZERO:
+			bzero(b, dlen);
+			break;
+
+			/* [DYN]RUBIN support required! */
+
+		default:
+			errmsg_die("Unsupported compression method!");
+	}
+
+	if (show_stats) {
+		dc->stats[n->compr].nodes++;
+		dc->stats[n->compr].bytes += je32_to_cpu(n->dsize);
+		dc->stats[n->compr].ns += now_ns() - t0;
+	}
+
+	return ret;
+}
+
+/* resolves which node supplies each byte of a file, like the kernel's
+   fragtree: where nodes overlap, the newest version wins, and data
+   beyond the size set by a newer node is truncated away. ranges are
+   swept in offset order with a heap of the nodes covering the current
+   offset, so this takes O(n log n) for n nodes. */
+
+/*
+   dc      - decoder, receives the fragment list in dc->frags
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   isize   - result file size
+
+   return value: number of fragments, in offset order. holes have no
+   fragment.
+ */
+
+static size_t SPECIALISE(build_frags)(struct decoder *dc, char *o, struct inode_info *ii,
+		uint32_t *isize)
+{
+	struct jffs2_raw_inode *n;
+	uint32_t *start, i, k, top, cur, next, limit, newest = 0;
+	size_t si = 0, nheap = 0, nstarts = 0, nfrags = 0;
+	struct frag *f;
+
+	if (ii->nnodes > dc->nodealloc) {
+		dc->nodealloc = ii->nnodes;
+		dc->order = xrealloc(dc->order, dc->nodealloc * sizeof(uint32_t));
+		dc->heap = xrealloc(dc->heap, dc->nodealloc * sizeof(uint32_t));
+		dc->end = xrealloc(dc->end, dc->nodealloc * 2 * sizeof(uint32_t));
+	}
+	start = dc->end + dc->nodealloc;
+
+	/* clip every node to the smallest size set by it or a newer node */
+	limit = UINT32_MAX;
+	*isize = 0;
+	for (i = ii->nnodes; i-- > 0; ) {
+		if (ii->nodes[i].flags & NODE_BAD)
+			continue;
+		n = &(NODE_AT(o, &ii->nodes[i])->i);
+		if (je32_to_cpu(n->isize) < limit)
+			limit = je32_to_cpu(n->isize);
+		if (!newest++)
+			*isize = limit;
+
+		start[i] = je32_to_cpu(n->offset);
+		dc->end[i] = start[i] + je32_to_cpu(n->dsize);
+		if (dc->end[i] < start[i] || dc->end[i] > limit)
+			dc->end[i] = limit;
+		if (start[i] < dc->end[i])
+			dc->order[nstarts++] = i;
+	}
+
+	sort_starts = start;
+	qsort(dc->order, nstarts, sizeof(uint32_t), cmp_start);
+
+	cur = 0;
+	while (si < nstarts || nheap) {
+		/* drop nodes that no longer cover the current offset */
+		while (nheap && dc->end[dc->heap[0]] <= cur)
+			heap_pop(dc->heap, &nheap);
+
+		if (!nheap) {
+			if (si == nstarts)
+				break;
+			cur = start[dc->order[si]];
+		}
+
+		while (si < nstarts && start[dc->order[si]] <= cur)
+			heap_push(dc->heap, &nheap, dc->order[si++]);
+
+		while (nheap && dc->end[dc->heap[0]] <= cur)
+			heap_pop(dc->heap, &nheap);
+		if (!nheap)
+			continue;
+
+		/* the newest covering node supplies data up to its end or
+		   the start of a node that may be newer */
+		top = dc->heap[0];
+		next = dc->end[top];
+		if (si < nstarts && start[dc->order[si]] < next)
+			next = start[dc->order[si]];
+
+		k = cur - start[top];
+		if (nfrags && dc->frags[nfrags - 1].node == top &&
+				dc->frags[nfrags - 1].ofs + dc->frags[nfrags - 1].len == cur) {
+			dc->frags[nfrags - 1].len += next - cur;
+		} else {
+			f = add_frag(dc, &nfrags);
+			f->ofs = cur;
+			f->len = next - cur;
+			f->node = top;
+			f->node_ofs = k;
+		}
+
+		cur = next;
+	}
+
+	return nfrags;
+}
+
+/* checks the node CRC of a raw inode node the first time its header
+   is used, and that the node is the one the index expects: nodes
+   indexed from a summary have not been read yet, and a stale summary
+   may name the wrong inode or version. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   r       - node
+
+   return value: 1 if the node has just been found bad, 0 otherwise
+ */
+
+static int SPECIALISE(check_header)(struct decoder *dc, char *o, struct node_ref *r)
+{
+	struct jffs2_raw_inode *n = &(NODE_AT(o, r)->i);
+	uint32_t totlen;
+
+	if (r->flags & (NODE_HEADER | NODE_CHECKED))
+		return 0;
+	r->flags |= NODE_HEADER;
+
+	totlen = je32_to_cpu(n->totlen);
+	if (jffs2_crc32(0, n, sizeof(*n) - 8) == je32_to_cpu(n->node_crc) &&
+			je16_to_cpu(n->nodetype) == JFFS2_NODETYPE_INODE &&
+			totlen >= sizeof(*n) && totlen <= idx.size - r->ofs &&
+			je32_to_cpu(n->csize) <= totlen - sizeof(*n)) {
+		if (je32_to_cpu(n->ino) == r->ino && je32_to_cpu(n->version) == r->version)
+			return 0;
+		warnmsg("Node at 0x%08x is not inode %u version %u, node ignored",
+				r->ofs, r->ino, r->version);
+	} else {
+		warnmsg("CRC mismatch in inode %u version %u, node ignored",
+				r->ino, r->version);
+	}
+
+	r->flags |= NODE_BAD;
+	dc->badcrc++;
+	return 1;
+}
+
+/* checks the node and data CRCs of a raw inode node the first time it
+   supplies file data. the data CRC of nodes that are never live is not
+   computed. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   r       - node
+
+   return value: 1 if the node has just been found bad, 0 otherwise
+ */
+
+static int SPECIALISE(check_node)(struct decoder *dc, char *o, struct node_ref *r)
+{
+	struct jffs2_raw_inode *n = &(NODE_AT(o, r)->i);
+	int bad;
+
+	if (r->flags & NODE_CHECKED)
+		return 0;
+	bad = SPECIALISE(check_header)(dc, o, r);
+	r->flags |= NODE_CHECKED;
+	if (r->flags & NODE_BAD)
+		return bad;
+
+	if (jffs2_crc32(0, n->data, je32_to_cpu(n->csize)) == je32_to_cpu(n->data_crc))
+		return 0;
+
+	warnmsg("CRC mismatch in inode %u version %u, node ignored",
+			r->ino, r->version);
+	r->flags |= NODE_BAD;
+	dc->badcrc++;
+	return 1;
+}
+
+/* works out which parts of which nodes make up a file. overlaps are
+   resolved first, so each node that still supplies data is decoded
+   once and fully overwritten nodes are never decoded. */
+
+/*
+   dc      - decoder, receives the fragments in dc->frags, grouped by
+             node
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   isize   - result file size
+
+   return value: number of fragments
+ */
+
+static size_t SPECIALISE(plan_file)(struct decoder *dc, char *o,
+		struct inode_info *ii, uint32_t *isize)
+{
+	size_t i, nfrags, used = 0;
+	int bad;
+
+	/* build_frags trusts the sizes and offsets in the headers */
+	for (i = 0; i < ii->nnodes; i++)
+		SPECIALISE(check_header)(dc, o, &ii->nodes[i]);
+
+	/* older data shows through where a live node turns out to be bad */
+	do {
+		nfrags = SPECIALISE(build_frags)(dc, o, ii, isize);
+		for (i = 0, bad = 0; i < nfrags; i++)
+			bad |= SPECIALISE(check_node)(dc, o, &ii->nodes[dc->frags[i].node]);
+	} while (bad);
+
+	/* group fragments by node so every node is decoded once. an empty
+	   file may not have a fragment array yet */
+	if (nfrags)
+		qsort(dc->frags, nfrags, sizeof(struct frag), cmp_frag_node);
+
+	for (i = 0; i < nfrags; i++)
+		if (i == 0 || dc->frags[i].node != dc->frags[i - 1].node)
+			used++;
+	dc->obsolete += ii->nnodes - used;
+
+	return nfrags;
+}
+
+/* sends fragments of a file to the output file. nodes are decoded into
+   buffers from the sink, one node at a time. zero nodes are not written. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   frags   - fragments from plan_file. a node is decoded again for
+             each run of its fragments, so grouped by node is cheapest
+   nfrags  - number of fragments
+   out     - output file
+
+   return value: 0 on success, -1 on write errors
+ */
+
+static int SPECIALISE(write_frags)(struct decoder *dc, char *o,
+		struct inode_info *ii, const struct frag *frags, size_t nfrags,
+		struct file_sink *out)
+{
+	struct jffs2_raw_inode *n = NULL;
+	const struct frag *f;
+	const char *data = NULL;
+	char *buf;
+	size_t i;
+	uint32_t dsize, last = UINT32_MAX;
+	int ok = 0;
+
+	for (i = 0; i < nfrags; i++) {
+		f = &frags[i];
+
+		if (f->node != last) {
+			last = f->node;
+
+			n = &(NODE_AT(o, &ii->nodes[f->node])->i);
+			dsize = je32_to_cpu(n->dsize);
+
+			/* uncompressed data is written straight from the image.
+			   zeros are not written at all: the output file starts
+			   empty, so skipping them leaves a hole. */
+			if (n->compr == JFFS2_COMPR_ZERO ||
+					(n->compr == JFFS2_COMPR_NONE && je32_to_cpu(n->csize) >= dsize)) {
+				data = n->compr == JFFS2_COMPR_NONE ? (const char *) n->data : NULL;
+				ok = 1;
+				if (show_stats) {
+					dc->stats[n->compr].nodes++;
+					dc->stats[n->compr].bytes += dsize;
+				}
+			} else {
+				data = buf = out->buffer(out, dc, dsize);
+				ok = SPECIALISE(decode_node)(dc, n, buf) == 0;
+			}
+		}
+
+		if (!ok || !data)
+			continue;
+
+		if (out->write(out, data + f->node_ofs, f->len, f->ofs))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* writes the live data of a file at its offsets in the output file.
+   holes and zero nodes are left as holes in the output file. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   fd      - output file, opened for writing and empty
+
+   return value: 0 on success, -1 on write errors
+ */
+
+static int SPECIALISE(putfile)(struct decoder *dc, char *o, struct inode_info *ii, int fd)
+{
+	struct file_sink out = { decoder_buffer, write_fd, fd, 0 };
+	size_t nfrags;
+	uint32_t isize;
+
+	nfrags = SPECIALISE(plan_file)(dc, o, ii, &isize);
+	if (SPECIALISE(write_frags)(dc, o, ii, dc->frags, nfrags, &out))
+		return -1;
+
+	/* sets the size, which also creates any trailing hole */
+	if (out.end != isize && ftruncate(fd, isize))
+		return -1;
+
+	return 0;
+}
+
+/* records every INODE and DIRENT node starting in a range of the image.
+   every step moves forward by at least four bytes, and a node is only
+   skipped as a whole if its header CRC vouches for a length that stays
+   inside the image, so the scan is linear in the size of the range
+   whatever the image contains. */
+
+/*
+   p       - scan part receiving the nodes
+   from    - where to start
+   to      - where to stop looking for nodes
+
+   return value: where the scan ended, at or past to
+ */
+
+static size_t SPECIALISE(scan_nodes)(struct scan_part *p, size_t from, size_t to)
+{
+	char *o = p->o;
+	/* aligned! */
+	union jffs2_node_union *n = (union jffs2_node_union *) (o + from);
+	union jffs2_node_union *l = (union jffs2_node_union *) (o + to);
+	union jffs2_node_union *e = (union jffs2_node_union *) (o + p->size);
+	struct node_ref *r;
+	char *erased;
+	uint32_t totlen;
+	uint16_t magic = t16(JFFS2_MAGIC_BITMASK);
+
+	while (n < l) {
+		if ((char *) n + 4 <= (char *) l && n->u.magic.v16 == 0xffff &&
+				n->u.nodetype.v16 == 0xffff) {
+			erased = (char *) n;
+			n = (union jffs2_node_union *) skip_erased(erased, (char *) l);
+			add_extent(&p->erased, &p->nerased, &p->ealloc,
+					erased - o, (char *) n - erased);
+			continue;
+		}
+
+		n = (union jffs2_node_union *) find_magic((char *) n, (char *) l, magic);
+
+		if (n >= l || (char *) n + sizeof(struct jffs2_unknown_node) > (char *) e)
+			break;
+
+		/* a torn header, a stray magic word or a length that is too
+		   short or runs off the image: look again right after it */
+		totlen = je32_to_cpu(n->u.totlen);
+		if (jffs2_crc32(0, n, sizeof(struct jffs2_unknown_node) - 4) !=
+				je32_to_cpu(n->u.hdr_crc) ||
+				totlen < sizeof(struct jffs2_unknown_node) ||
+				totlen > (size_t) ((char *) e - (char *) n)) {
+			ADD_BYTES(n, 4);
+			continue;
+		}
+
+		switch (je16_to_cpu(n->u.nodetype)) {
+			case JFFS2_NODETYPE_INODE:
+				if (totlen < sizeof(struct jffs2_raw_inode) ||
+						jffs2_crc32(0, n, sizeof(struct jffs2_raw_inode) - 8) !=
+							je32_to_cpu(n->i.node_crc) ||
+						je32_to_cpu(n->i.csize) > totlen - sizeof(struct jffs2_raw_inode)) {
+					p->nbadcrc++;
+					break;
+				}
+				/* the data CRC is checked if the node turns out to be live */
+				r = add_node_ref(&p->inodes, &p->ninodes, &p->ialloc);
+				r->ofs = (char *) n - o;
+				r->ino = je32_to_cpu(n->i.ino);
+				r->pino = 0;
+				r->version = je32_to_cpu(n->i.version);
+				r->type = JFFS2_NODETYPE_INODE;
+				r->flags = NODE_HEADER;
+				break;
+
+			case JFFS2_NODETYPE_DIRENT:
+				if (totlen < sizeof(struct jffs2_raw_dirent) ||
+						totlen < sizeof(struct jffs2_raw_dirent) + n->d.nsize ||
+						jffs2_crc32(0, n, sizeof(struct jffs2_raw_dirent) - 8) !=
+							je32_to_cpu(n->d.node_crc) ||
+						jffs2_crc32(0, n->d.name, n->d.nsize) !=
+							je32_to_cpu(n->d.name_crc)) {
+					p->nbadcrc++;
+					break;
+				}
+				r = add_node_ref(&p->dirents, &p->ndirents, &p->dalloc);
+				r->ofs = (char *) n - o;
+				r->ino = je32_to_cpu(n->d.ino);
+				r->pino = je32_to_cpu(n->d.pino);
+				r->version = je32_to_cpu(n->d.version);
+				r->name_crc = je32_to_cpu(n->d.name_crc);
+				r->type = JFFS2_NODETYPE_DIRENT;
+				break;
+		}
+
+		ADD_BYTES(n, ((size_t) totlen + 3) & ~(size_t) 3);
+	}
+
+	return (char *) n - o;
+}
+
+/* records the INODE and DIRENT nodes of an erase block from the summary
+   at its end, without reading the nodes themselves. */
+
+/*
+   p       - scan part receiving the nodes
+   blk     - offset of the erase block
+
+   return value: 1 if the block has a valid summary, 0 if it has to
+   be scanned
+ */
+
+static int SPECIALISE(scan_summary)(struct scan_part *p, size_t blk)
+{
+	char *b = p->o + blk;
+	struct jffs2_sum_marker *sm;
+	struct jffs2_raw_summary *s;
+	union jffs2_sum_flash *sp;
+	union jffs2_node_union *n;
+	struct node_ref *r;
+	size_t ninodes = p->ninodes, ndirents = p->ndirents, nbadcrc = p->nbadcrc;
+	uint32_t i, sofs, ofs, totlen, es = p->erasesize;
+
+	sm = (struct jffs2_sum_marker *) (b + es - sizeof(struct jffs2_sum_marker));
+	if (je32_to_cpu(sm->magic) != JFFS2_SUM_MAGIC)
+		return 0;
+
+	sofs = je32_to_cpu(sm->offset);
+	if (sofs > es - JFFS2_SUMMARY_FRAME_SIZE || (sofs & 3))
+		return 0;
+
+	s = (struct jffs2_raw_summary *) (b + sofs);
+	if (je16_to_cpu(s->magic) != JFFS2_MAGIC_BITMASK ||
+			je16_to_cpu(s->nodetype) != JFFS2_NODETYPE_SUMMARY ||
+			jffs2_crc32(0, s, sizeof(struct jffs2_unknown_node) - 4) !=
+				je32_to_cpu(s->hdr_crc) ||
+			jffs2_crc32(0, s, sizeof(*s) - 8) != je32_to_cpu(s->node_crc) ||
+			jffs2_crc32(0, s->sum, es - sofs - sizeof(*s)) !=
+				je32_to_cpu(s->sum_crc))
+		return 0;
+
+	sp = (union jffs2_sum_flash *) s->sum;
+
+	for (i = 0; i < je32_to_cpu(s->sum_num); i++) {
+		if ((char *) sp + sizeof(struct jffs2_sum_unknown_flash) > (char *) sm)
+			goto bad;
+
+		switch (je16_to_cpu(sp->u.nodetype)) {
+			case JFFS2_NODETYPE_INODE:
+				if ((char *) sp + JFFS2_SUMMARY_INODE_SIZE > (char *) sm)
+					goto bad;
+				ofs = je32_to_cpu(sp->i.offset);
+				totlen = je32_to_cpu(sp->i.totlen);
+				if (sofs < sizeof(struct jffs2_raw_inode) ||
+						(uint64_t) ofs + sizeof(struct jffs2_raw_inode) > sofs ||
+						(uint64_t) ofs + totlen > sofs ||
+						(uint64_t) blk + ofs + totlen > p->size)
+					goto bad;
+				r = add_node_ref(&p->inodes, &p->ninodes, &p->ialloc);
+				r->ofs = blk + ofs;
+				r->ino = je32_to_cpu(sp->i.inode);
+				r->pino = 0;
+				r->version = je32_to_cpu(sp->i.version);
+				r->type = JFFS2_NODETYPE_INODE;
+				ADD_BYTES(sp, JFFS2_SUMMARY_INODE_SIZE);
+				break;
+
+			case JFFS2_NODETYPE_DIRENT:
+				if ((char *) sp + JFFS2_SUMMARY_DIRENT_SIZE(0) > (char *) sm ||
+						(char *) sp + JFFS2_SUMMARY_DIRENT_SIZE(sp->d.nsize) >
+						(char *) sm)
+					goto bad;
+				ofs = je32_to_cpu(sp->d.offset);
+				totlen = je32_to_cpu(sp->d.totlen);
+				if (sofs < sizeof(struct jffs2_raw_dirent) ||
+						(uint64_t) ofs + sizeof(struct jffs2_raw_dirent) > sofs ||
+						(uint64_t) ofs + totlen > sofs ||
+						(uint64_t) blk + ofs + totlen > p->size)
+					goto bad;
+				ADD_BYTES(sp, JFFS2_SUMMARY_DIRENT_SIZE(sp->d.nsize));
+
+				/* the tree is built from the name on flash, so the
+				   node is checked as a scan would, and everything
+				   but its place is taken from the node */
+				n = (union jffs2_node_union *) (b + ofs);
+				if (je16_to_cpu(n->d.nodetype) != JFFS2_NODETYPE_DIRENT ||
+						totlen < sizeof(struct jffs2_raw_dirent) + n->d.nsize ||
+						jffs2_crc32(0, n, sizeof(struct jffs2_raw_dirent) - 8) !=
+							je32_to_cpu(n->d.node_crc) ||
+						jffs2_crc32(0, n->d.name, n->d.nsize) !=
+							je32_to_cpu(n->d.name_crc)) {
+					p->nbadcrc++;
+					break;
+				}
+				r = add_node_ref(&p->dirents, &p->ndirents, &p->dalloc);
+				r->ofs = blk + ofs;
+				r->ino = je32_to_cpu(n->d.ino);
+				r->pino = je32_to_cpu(n->d.pino);
+				r->version = je32_to_cpu(n->d.version);
+				r->name_crc = je32_to_cpu(n->d.name_crc);
+				r->type = JFFS2_NODETYPE_DIRENT;
+				break;
+
+			case JFFS2_NODETYPE_XATTR:
+				ADD_BYTES(sp, JFFS2_SUMMARY_XATTR_SIZE);
+				break;
+
+			case JFFS2_NODETYPE_XREF:
+				ADD_BYTES(sp, JFFS2_SUMMARY_XREF_SIZE);
+				break;
+
+			default:
+				goto bad;
+		}
+	}
+
+	return 1;
+
+bad:
+	/* forget what this summary added, the block is scanned instead */
+	p->ninodes = ninodes;
+	p->ndirents = ndirents;
+	p->nbadcrc = nbadcrc;
+	return 0;
+}
+
+/* records every INODE and DIRENT node starting in one range of the
+   image. runs on a worker thread when the scan is parallel. erase
+   blocks with a valid summary are not scanned. */
+
+static void *SPECIALISE(scan_part)(void *arg)
+{
+	struct scan_part *p = arg;
+	size_t blk, pos = p->start;
+
+	if (!p->erasesize)
+		pos = SPECIALISE(scan_nodes)(p, p->start, p->end);
+	else
+		for (blk = p->start; blk < p->end; blk += p->erasesize) {
+			p->nblocks++;
+			if (blk + p->erasesize <= p->size && blk >= pos &&
+					SPECIALISE(scan_summary)(p, blk)) {
+				p->nsumblocks++;
+				pos = blk + p->erasesize;
+				continue;
+			}
+			pos = SPECIALISE(scan_nodes)(p, MAX(blk, pos), MIN(blk + p->erasesize, p->end));
+		}
+
+	p->stop = pos;
+
+	/* a range without nodes has no arrays */
+	if (p->ninodes)
+		qsort(p->inodes, p->ninodes, sizeof(struct node_ref), cmp_node_ref);
+	if (p->ndirents)
+		qsort(p->dirents, p->ndirents, sizeof(struct node_ref), cmp_node_ref);
+
+	return NULL;
+}
+
+#undef SPECIALISE
+#pragma pop_macro("t32")
+#pragma pop_macro("t16")
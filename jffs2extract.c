@@ -27,7 +27,10 @@
  *
  * 
  *
- * Usage: jffs2extract {-t | -x} [-f imagefile] [-C path] [-v] [file1 [file2 ...]]
+ * Usage: jffs2extract {-t | -x | --to-tar archive | -O tar} [-f imagefile]
+ *                     [-C path] [-v] [-e erasesize] [-j threads]
+ *                     [--io-threads n] [--io-uring] [--stats]
+ *                     [--no-summary] [file1 [file2 ...]]
  *
  * Options mimic the 'tar' command as close as possible.
  *
@@ -40,15 +43,40 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <tar.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
 #include <zlib.h>
 
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* direct descriptors and sparse file tables need the 5.19 headers */
+#if defined(IORING_RSRC_REGISTER_SPARSE) && defined(IORING_FILE_INDEX_ALLOC)
+#define HAVE_IO_URING 1
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#endif
+
 #include "include/jffs2-user.h"
 #include "include/common.h"
+#include "include/crc32.h"
+#include "include/summary.h"
+#include "include/minilzo.h"
 
 #define SCRATCH_SIZE (5*1024*1024)
 
@@ -58,21 +86,193 @@
 #define DIRENT_INO(dirent) ((dirent) !=NULL ? je32_to_cpu((dirent)->ino) : 0)
 #define DIRENT_PINO(dirent) ((dirent) !=NULL ? je32_to_cpu((dirent)->pino) : 0)
 
+/* entry of a directory in the tree built by build_tree */
 struct dir {
-	struct dir *next;
+	struct dir *next;			/* next live entry of the same directory */
+	const char *name;			/* interned, NUL terminated */
+	uint32_t ino;
 	uint8_t type;
 	uint8_t nsize;
+	uint8_t unlinked;			/* removed by a newer dirent */
+};
+
+/* reference to an INODE or DIRENT node in the image */
+struct node_ref {
+	uint32_t ofs;				/* offset of node in the image */
+	uint32_t ino;				/* inode number, zero for unlink dirents */
+	uint32_t pino;				/* parent inode, DIRENT nodes only */
+	uint32_t version;
+	uint32_t name_crc;			/* DIRENT nodes only */
+	uint16_t type;				/* JFFS2_NODETYPE_INODE or JFFS2_NODETYPE_DIRENT */
+	uint16_t flags;				/* NODE_CHECKED, NODE_BAD, NODE_HEADER */
+};
+
+#define NODE_CHECKED	0x01	/* node and data CRC of INODE node checked */
+#define NODE_BAD		0x02	/* ... and found not to match */
+#define NODE_HEADER		0x04	/* node CRC of INODE node checked */
+
+/* raw inode nodes of one inode, in version order, and the attributes
+   of the inode as set by the newest one that is not bad */
+struct inode_info {
+	uint32_t ino;
+	uint32_t nnodes;
+	struct node_ref *nodes;		/* points into node_index.inodes */
+	int visiting;				/* directory is being listed or extracted */
+	uint32_t meta;				/* node of the attributes, nnodes if none */
+	uint32_t version;			/* newest version */
+	uint32_t isize;
+	uint32_t mode;
+	uint32_t uid, gid;
+	uint32_t mtime, ctime;
+	dev_t rdev;					/* device files only */
+};
+
+/* directory in the tree: its live entries, and a hash of its entries
+   by name */
+struct dir_node {
+	uint32_t ino;
+	struct dir *entries;		/* in the order they were created */
+	struct dir **slots;			/* open addressing, keyed by interned name */
+	uint32_t nslots;			/* power of two */
+};
+
+/* hash slot of an interned name */
+struct intern_slot {
+	uint32_t hash;				/* name CRC */
+	uint8_t nsize;
+	const char *name;			/* NULL if the slot is free */
+};
+
+/* block of memory the directory tree is allocated from */
+struct arena_chunk {
+	struct arena_chunk *next;
+	char data[];
+};
+
+#define ARENA_CHUNK (64 * 1024)
+
+/* directory tree of the image, built once from the index. entries,
+   names and hash tables live in an arena that is freed as a whole. */
+struct dir_tree {
+	struct dir_node *dirs;		/* sorted by ino */
+	size_t ndirs;
+	size_t nentries;
+	struct intern_slot *names;	/* open addressing, keyed by name */
+	size_t nnames, nnameslots;	/* power of two */
+	struct arena_chunk *chunks;
+	char *cur, *end;			/* free part of the newest chunk */
+	size_t used;				/* bytes allocated for chunks */
+};
+
+/* hash slot for the newest dirent of a (parent inode, name) pair */
+struct name_slot {
+	uint32_t hash;
+	struct node_ref *dirent;	/* NULL if the slot is free */
+};
+
+/* hash slot mapping an inode to the newest live dirent naming it */
+struct ino_slot {
 	uint32_t ino;
-	char name[256];
+	struct node_ref *dirent;	/* NULL if the slot is free */
+};
+
+/* range of erased flash (0xff bytes) in the image */
+struct extent {
+	uint32_t ofs;
+	uint32_t len;
+};
+
+/* index of all INODE and DIRENT nodes, built by one pass over the image */
+struct node_index {
+	struct node_ref *inodes;	/* sorted by ino, version */
+	size_t ninodes;
+	struct inode_info *inos;	/* sorted by ino */
+	size_t ninos;
+	struct node_ref *dirents;	/* sorted by pino, version */
+	size_t ndirents;
+	struct name_slot *names;	/* open addressing, keyed by pino and name */
+	size_t nslots;				/* power of two */
+	struct ino_slot *links;		/* open addressing, keyed by ino */
+	size_t nlinkslots;			/* power of two */
+	struct extent *erased;		/* sorted by offset */
+	size_t nerased;
+	unsigned long erasesize;	/* zero if unknown */
+	size_t nblocks;				/* erase blocks */
+	size_t nsumblocks;			/* erase blocks read from their summary */
+	size_t nbadcrc;				/* nodes dropped for a CRC mismatch */
+	size_t size;				/* of the image */
+};
+
+/* decompression statistics of one compression method */
+struct decode_stats {
+	uint64_t nodes;
+	uint64_t bytes;				/* decompressed bytes */
+	uint64_t ns;				/* time spent decompressing */
+};
+
+/* range of file data supplied by one node, after overlaps are resolved */
+struct frag {
+	uint32_t ofs;				/* offset in the file */
+	uint32_t len;
+	uint32_t node;				/* index into inode_info.nodes */
+	uint32_t node_ofs;			/* offset into the node's data */
+};
+
+/* decompression state kept across nodes */
+struct decoder {
+	z_stream zs;				/* raw inflate stream, reset per node */
+	int zinit;
+	char *buf;					/* node data buffer for file assembly */
+	size_t bufsize;
+	struct frag *frags;			/* fragment list of the current file */
+	uint32_t *order;			/* scratch space for build_frags */
+	uint32_t *heap;
+	uint32_t *end;
+	size_t fragalloc, nodealloc;
+	uint64_t obsolete;			/* nodes never decoded, fully overwritten */
+	uint64_t badcrc;			/* live nodes dropped for a CRC mismatch */
+	struct decode_stats stats[JFFS2_COMPR_LZO + 1];
+};
+
+/* output file of write_frags. data passed to write is either in the
+   image or in a buffer from the sink, which stays valid at least until
+   the next call to buffer. */
+struct file_sink {
+	char *(*buffer)(struct file_sink *, struct decoder *, size_t len);
+	int (*write)(struct file_sink *, const char *data, size_t len, off_t ofs);
+	int fd;
+	off_t end;					/* end of the data written so far */
 };
 
 int target_endian = __BYTE_ORDER;
 
-void putblock(char *, size_t, size_t *, struct jffs2_raw_inode *);
-struct dir *putdir(struct dir *, struct jffs2_raw_dirent *);
-void printdir(char *o, size_t size, struct dir *d, const char *path, 
-     int verbose);
-void freedir(struct dir *);
+static struct node_index idx;
+static struct dir_tree tree;
+static struct decoder dec;
+static int show_stats;
+static int use_summary = 1;
+
+#define NODE_AT(o, ref) ((union jffs2_node_union *) ((o) + (ref)->ofs))
+
+int decode_node(struct decoder *, struct jffs2_raw_inode *, char *);
+void putblock(struct decoder *, char *, size_t, size_t *,
+		struct jffs2_raw_inode *);
+int putfile(struct decoder *, char *, struct inode_info *, int);
+size_t plan_file(struct decoder *, char *, struct inode_info *, uint32_t *);
+int write_frags(struct decoder *, char *, struct inode_info *,
+		const struct frag *, size_t, struct file_sink *);
+char *read_symlink(struct decoder *, char *, struct inode_info *);
+void free_decoder(struct decoder *);
+struct dir *dir_entries(uint32_t ino);
+
+int detect_endian(char *o, size_t size);
+unsigned long detect_erase_size(char *o, size_t size);
+void build_index(char *o, size_t size, int nthreads, unsigned long erasesize);
+void free_index(void);
+struct inode_info *lookup_inode(uint32_t ino);
+struct node_ref *lookup_name(char *o, uint32_t pino, const char *name,
+		uint8_t nsize);
+struct node_ref *lookup_link(uint32_t ino);
 
 struct jffs2_raw_inode *find_raw_inode(char *o, size_t size, uint32_t ino, uint32_t vcur);
 struct jffs2_raw_dirent *resolvedirent(char *, size_t, uint32_t, uint32_t,
@@ -85,132 +285,441 @@ struct jffs2_raw_dirent *resolvepath0(char *, size_t, uint32_t, const char *,
 struct jffs2_raw_dirent *resolvepath(char *, size_t, uint32_t, const char *,
 		uint32_t *);
 		
-typedef void (*visitor)(char* imagebuf, size_t imagesize, struct dir *d, char m, 
-    struct jffs2_raw_inode *ri, uint32_t len, const char *path, int verbose);
+typedef void (*visitor)(char* imagebuf, size_t imagesize, uint32_t pino, struct dir *d, char m, 
+    struct inode_info *ii, uint32_t len, const char *path, int verbose);
 void visit(char *o, size_t size, const char *path, int verbose, visitor visitor);
+void start_pool(char *o, int nthreads, int nio);
+void finish_pool(struct decoder *dc);
+void free_handles(void);
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* inflates a zlib stream with the decoder's reusable inflate state.
+   like the kernel, the zlib header is skipped and raw deflate data is
+   inflated, which also skips the adler32 check. */
+
+/*
+   dc      - decoder
+   dst     - output buffer
+   dlen    - output buffer size, result size
+   src     - zlib stream
+   slen    - length of zlib stream
+
+   return value: zlib status code
+ */
+
+static int zlib_inflate(struct decoder *dc, Bytef *dst, uLongf *dlen,
+		const Bytef *src, uLong slen)
+{
+	int ret;
+
+	/* without a preset dictionary the header is two bytes */
+	if (slen < 2 || (src[0] & 0x0f) != Z_DEFLATED ||
+			((src[0] << 8) | src[1]) % 31 || (src[1] & 0x20))
+		return uncompress(dst, dlen, src, slen);
+
+	if (!dc->zinit) {
+		memset(&dc->zs, 0, sizeof(dc->zs));
+		if (inflateInit2(&dc->zs, -MAX_WBITS) != Z_OK)
+			errmsg_die("Unable to initialise zlib");
+		dc->zinit = 1;
+	} else
+		inflateReset(&dc->zs);
+
+	dc->zs.next_in = (Bytef *) src + 2;
+	dc->zs.avail_in = slen - 2;
+	dc->zs.next_out = dst;
+	dc->zs.avail_out = *dlen;
+
+	ret = inflate(&dc->zs, Z_FINISH);
+	*dlen = dc->zs.total_out;
+
+	return ret == Z_STREAM_END ? Z_OK : (ret == Z_OK ? Z_BUF_ERROR : ret);
+}
+
+/* releases the decoder's inflate state */
+
+void free_decoder(struct decoder *dc)
+{
+	if (dc->zinit)
+		inflateEnd(&dc->zs);
+	dc->zinit = 0;
+	free(dc->buf);
+	free(dc->frags);
+	free(dc->order);
+	free(dc->heap);
+	free(dc->end);
+	dc->buf = NULL;
+	dc->frags = NULL;
+	dc->order = dc->heap = dc->end = NULL;
+	dc->bufsize = dc->fragalloc = dc->nodealloc = 0;
+}
 
 /* writes file node into buffer, to the proper position. */
 /* reading all valid nodes in version order reconstructs the file. */
 
 /*
+   dc      - decoder
    b       - buffer
    bsize   - buffer size
    rsize   - result size
    n       - node
  */
 
-void putblock(char *b, size_t bsize, size_t * rsize,
+void putblock(struct decoder *dc, char *b, size_t bsize, size_t * rsize,
 		struct jffs2_raw_inode *n)
 {
-	uLongf dlen = je32_to_cpu(n->dsize);
-
-	if (je32_to_cpu(n->isize) > bsize || (je32_to_cpu(n->offset) + dlen) > bsize)
+	if (je32_to_cpu(n->isize) > bsize ||
+			(je32_to_cpu(n->offset) + je32_to_cpu(n->dsize)) > bsize)
 		errmsg_die("File does not fit into buffer!");
 
 	if (*rsize < je32_to_cpu(n->isize))
 		bzero(b + *rsize, je32_to_cpu(n->isize) - *rsize);
 
-	switch (n->compr) {
-		case JFFS2_COMPR_ZLIB:
-			uncompress((Bytef *) b + je32_to_cpu(n->offset), &dlen,
-					(Bytef *) ((char *) n) + sizeof(struct jffs2_raw_inode),
-					(uLongf) je32_to_cpu(n->csize));
-			break;
+	decode_node(dc, n, b + je32_to_cpu(n->offset));
 
-		case JFFS2_COMPR_NONE:
-			memcpy(b + je32_to_cpu(n->offset),
-					((char *) n) + sizeof(struct jffs2_raw_inode), dlen);
-			break;
+	*rsize = je32_to_cpu(n->isize);
+}
+
+/* writes a buffer at an offset of a file, retrying short writes */
+
+static int pwrite_all(int fd, const char *b, size_t len, off_t ofs)
+{
+	ssize_t r;
+
+	while (len) {
+		r = pwrite(fd, b, len, ofs);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		b += r;
+		len -= r;
+		ofs += r;
+	}
+
+	return 0;
+}
+
+/* returns the decoder's own buffer, grown to len bytes */
+
+static char *decoder_buffer(struct file_sink *out, struct decoder *dc, size_t len)
+{
+	if (len > dc->bufsize) {
+		dc->bufsize = len;
+		dc->buf = xrealloc(dc->buf, dc->bufsize);
+	}
+
+	return dc->buf;
+}
+
+/* writes data straight to the sink's file */
+
+static int write_fd(struct file_sink *out, const char *data, size_t len, off_t ofs)
+{
+	if (pwrite_all(out->fd, data, len, ofs))
+		return -1;
+	if (ofs + (off_t) len > out->end)
+		out->end = ofs + len;
+
+	return 0;
+}
+
+/* heap of node indexes ordered by version, which is the node index
+   itself since nodes are sorted by version. the newest node is on top. */
+
+static void heap_push(uint32_t *heap, size_t *n, uint32_t v)
+{
+	size_t i = (*n)++, p;
+
+	while (i > 0 && heap[p = (i - 1) / 2] < v) {
+		heap[i] = heap[p];
+		i = p;
+	}
+	heap[i] = v;
+}
+
+static void heap_pop(uint32_t *heap, size_t *n)
+{
+	size_t i = 0, c;
+	uint32_t v = heap[--(*n)];
 
-		case JFFS2_COMPR_ZERO:
-			bzero(b + je32_to_cpu(n->offset), dlen);
+	while ((c = 2 * i + 1) < *n) {
+		if (c + 1 < *n && heap[c + 1] > heap[c])
+			c++;
+		if (heap[c] <= v)
 			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = v;
+}
 
-			/* [DYN]RUBIN support required! */
+/* per thread, as extraction threads plan files concurrently */
+static __thread const uint32_t *sort_starts;
 
-		default:
-			errmsg_die("Unsupported compression method!");
+static int cmp_start(const void *a, const void *b)
+{
+	uint32_t x = sort_starts[*(const uint32_t *) a];
+	uint32_t y = sort_starts[*(const uint32_t *) b];
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_frag_node(const void *a, const void *b)
+{
+	const struct frag *x = a, *y = b;
+
+	if (x->node != y->node)
+		return x->node < y->node ? -1 : 1;
+	return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
+}
+
+static int cmp_frag_ofs(const void *a, const void *b)
+{
+	const struct frag *x = a, *y = b;
+
+	return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
+}
+
+static struct frag *add_frag(struct decoder *dc, size_t *nfrags)
+{
+	if (*nfrags == dc->fragalloc) {
+		dc->fragalloc = dc->fragalloc ? dc->fragalloc * 2 : 64;
+		dc->frags = xrealloc(dc->frags, dc->fragalloc * sizeof(struct frag));
 	}
 
-	*rsize = je32_to_cpu(n->isize);
+	return &dc->frags[(*nfrags)++];
 }
 
-/* adds/removes directory node into dir struct. */
-/* reading all valid nodes in version order reconstructs the directory. */
+/* allocates memory for the directory tree. it is only freed as a
+   whole, by free_tree. */
 
 /*
-   dd      - directory struct being processed
-   n       - node
+   len     - bytes needed
+   align   - required alignment, a power of two
 
-   return value: directory struct value replacing dd
+   return value: uninitialised memory
  */
 
-struct dir *putdir(struct dir *dd, struct jffs2_raw_dirent *n)
+static void *arena_alloc(size_t len, size_t align)
 {
-	struct dir *o, *d, *p;
+	struct arena_chunk *c;
+	size_t size;
+	char *p;
+
+	p = (char *) (((uintptr_t) tree.cur + align - 1) & ~(uintptr_t) (align - 1));
+	if (!tree.cur || p + len > tree.end) {
+		size = len + align > ARENA_CHUNK ? len + align : ARENA_CHUNK;
+		c = xmalloc(sizeof(struct arena_chunk) + size);
+		c->next = tree.chunks;
+		tree.chunks = c;
+		tree.cur = c->data;
+		tree.end = c->data + size;
+		tree.used += sizeof(struct arena_chunk) + size;
+		p = (char *) (((uintptr_t) tree.cur + align - 1) & ~(uintptr_t) (align - 1));
+	}
 
-	o = dd;
+	tree.cur = p + len;
+	return p;
+}
 
-	if (je32_to_cpu(n->ino)) {
-		if (dd == NULL) {
-			d = xmalloc(sizeof(struct dir));
-			d->type = n->type;
-			memcpy(d->name, n->name, n->nsize);
-			d->nsize = n->nsize;
-			d->ino = je32_to_cpu(n->ino);
-			d->next = NULL;
+/* returns the one copy of a name kept in the tree, adding it if new */
+
+/*
+   name    - name, not NUL terminated
+   nsize   - length of name
+   hash    - CRC of name
+
+   return value: NUL terminated name in the arena
+ */
 
-			return d;
+static const char *intern(const char *name, uint8_t nsize, uint32_t hash)
+{
+	struct intern_slot *old = tree.names, *s;
+	size_t i, h, nold = tree.nnameslots;
+	char *p;
+
+	if (2 * (tree.nnames + 1) > tree.nnameslots) {
+		tree.nnameslots = nold ? nold * 2 : 1024;
+		tree.names = xzalloc(tree.nnameslots * sizeof(struct intern_slot));
+		for (i = 0; i < nold; i++) {
+			if (!old[i].name)
+				continue;
+			for (h = old[i].hash & (tree.nnameslots - 1); tree.names[h].name;
+					h = (h + 1) & (tree.nnameslots - 1))
+				;
+			tree.names[h] = old[i];
 		}
+		free(old);
+	}
 
-		while (1) {
-			if (n->nsize == dd->nsize &&
-					!memcmp(n->name, dd->name, n->nsize)) {
-				dd->type = n->type;
-				dd->ino = je32_to_cpu(n->ino);
+	for (h = hash & (tree.nnameslots - 1); tree.names[h].name;
+			h = (h + 1) & (tree.nnameslots - 1)) {
+		s = &tree.names[h];
+		if (s->hash == hash && s->nsize == nsize && !memcmp(s->name, name, nsize))
+			return s->name;
+	}
 
-				return o;
-			}
+	p = arena_alloc(nsize + 1, 1);
+	memcpy(p, name, nsize);
+	p[nsize] = '\0';
 
-			if (dd->next == NULL) {
-				dd->next = xmalloc(sizeof(struct dir));
-				dd->next->type = n->type;
-				memcpy(dd->next->name, n->name, n->nsize);
-				dd->next->nsize = n->nsize;
-				dd->next->ino = je32_to_cpu(n->ino);
-				dd->next->next = NULL;
+	s = &tree.names[h];
+	s->hash = hash;
+	s->nsize = nsize;
+	s->name = p;
+	tree.nnames++;
 
-				return o;
-			}
+	return p;
+}
 
-			dd = dd->next;
-		}
-	} else {
-		if (dd == NULL)
-			return NULL;
+/* finds the hash slot of a name in a directory */
 
-		if (n->nsize == dd->nsize && !memcmp(n->name, dd->name, n->nsize)) {
-			d = dd->next;
-			free(dd);
-			return d;
-		}
+/*
+   dn      - directory
+   name    - interned name
+   hash    - CRC of name
+
+   return value: the slot holding the entry of that name, or the free
+   slot where it belongs
+ */
+
+static struct dir **dir_slot(struct dir_node *dn, const char *name, uint32_t hash)
+{
+	uint32_t h;
+
+	for (h = hash & (dn->nslots - 1); dn->slots[h] && dn->slots[h]->name != name;
+			h = (h + 1) & (dn->nslots - 1))
+		;
+
+	return &dn->slots[h];
+}
 
-		while (1) {
-			p = dd;
-			dd = dd->next;
+/* builds the directory tree from the index: for every directory, the
+   dirents are replayed in version order against a hash of its entries,
+   so a directory of n dirents takes O(n). entries are listed in the
+   order in which they were (last) created. */
 
-			if (dd == NULL)
-				return o;
+/*
+   o       - filesystem image pointer
+ */
 
-			if (n->nsize == dd->nsize &&
-					!memcmp(n->name, dd->name, n->nsize)) {
-				p->next = dd->next;
-				free(dd);
+static void build_tree(char *o)
+{
+	struct jffs2_raw_dirent *n;
+	struct dir_node *dn;
+	struct node_ref *r;
+	struct dir *d, **slot, **tail;
+	const char *name;
+	uint32_t hash;
+	size_t i, j, k;
+
+	for (i = 0, k = 0; i < idx.ndirents; i++)
+		if (i == 0 || idx.dirents[i].pino != idx.dirents[i - 1].pino)
+			k++;
+	tree.dirs = xmalloc(k * sizeof(struct dir_node));
+
+	for (i = 0; i < idx.ndirents; i = j) {
+		for (j = i; j < idx.ndirents && idx.dirents[j].pino == idx.dirents[i].pino; j++)
+			;
+
+		dn = &tree.dirs[tree.ndirs++];
+		dn->ino = idx.dirents[i].pino;
+		for (dn->nslots = 4; dn->nslots < 2 * (j - i); dn->nslots *= 2)
+			;
+		dn->slots = arena_alloc(dn->nslots * sizeof(struct dir *),
+				sizeof(struct dir *));
+		memset(dn->slots, 0, dn->nslots * sizeof(struct dir *));
+
+		tail = &dn->entries;
+		for (k = i; k < j; k++) {
+			r = &idx.dirents[k];
+			n = &(NODE_AT(o, r)->d);
+			hash = r->name_crc;
+			name = intern((const char *) n->name, n->nsize, hash);
+			slot = dir_slot(dn, name, hash);
+			d = *slot;
+
+			if (!r->ino) {
+				if (d)
+					d->unlinked = 1;
+				continue;
+			}
 
-				return o;
+			if (d && !d->unlinked) {
+				d->ino = r->ino;
+				d->type = n->type;
+				continue;
 			}
+
+			/* new, or created again after an unlink */
+			d = arena_alloc(sizeof(struct dir), sizeof(void *));
+			d->name = name;
+			d->ino = r->ino;
+			d->type = n->type;
+			d->nsize = n->nsize;
+			d->unlinked = 0;
+			*slot = d;
+			*tail = d;
+			tail = &d->next;
+			tree.nentries++;
 		}
+		*tail = NULL;
+
+		for (tail = &dn->entries; *tail; )
+			if ((*tail)->unlinked)
+				*tail = (*tail)->next;
+			else
+				tail = &(*tail)->next;
+	}
+}
+
+/* frees the directory tree */
+
+static void free_tree(void)
+{
+	struct arena_chunk *c;
+
+	while ((c = tree.chunks)) {
+		tree.chunks = c->next;
+		free(c);
+	}
+	free(tree.dirs);
+	free(tree.names);
+	memset(&tree, 0, sizeof(tree));
+}
+
+/* finds the entries of a directory */
+
+/*
+   ino     - inode of the directory
+
+   return value: live entries in creation order, NULL if there are none
+ */
+
+struct dir *dir_entries(uint32_t ino)
+{
+	size_t lo = 0, hi = tree.ndirs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tree.dirs[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	if (lo == tree.ndirs || tree.dirs[lo].ino != ino)
+		return NULL;
+	return tree.dirs[lo].entries;
 }
 
 
@@ -256,17 +765,17 @@ const char *mode_string(int mode)
 	return buf;
 }
 
-/* prints contents of directory structure */
+/* visits the entries of a directory, and of its subdirectories */
 
 /*
-   d       - dir struct
+   ino     - inode of the directory
  */
 
-void visitdir(char *o, size_t size, struct dir *d, const char *path, int verbose, visitor visitor)
+void visitdir(char *o, size_t size, uint32_t ino, const char *path, int verbose, visitor visitor)
 {
 	char m;
-	uint32_t len = 0;
-	struct jffs2_raw_inode *ri, *tmpi;
+	struct inode_info *ii;
+	struct dir *d = dir_entries(ino);
 
 	if (!path) {
 	    path = "/";
@@ -307,26 +816,25 @@ void visitdir(char *o, size_t size, struct dir *d, const char *path, int verbose
 			default:
 				m = '?';
 		}
-		ri = find_raw_inode(o, size, d->ino, 0);
-		if (!ri) {
+		ii = lookup_inode(d->ino);
+		if (!ii) {
 			warnmsg("bug: raw_inode missing!");
 			d = d->next;
 			continue;
 		}
-		/* Search for newer versions of the inode */
-		tmpi = ri;
-		while (tmpi) {
-			len = je32_to_cpu(tmpi->dsize) + je32_to_cpu(tmpi->offset);
-			tmpi = find_raw_inode(o, size, d->ino, je32_to_cpu(tmpi->version));
-		}
-		
-		visitor(o, size, d, m, ri, len, path, verbose);
+		visitor(o, size, ino, d, m, ii, ii->isize, path, verbose);
 
-		if (d->type == DT_DIR) {
+		/* a directory that is its own ancestor is only possible in a
+		   corrupt image, and would be descended into forever */
+		if (d->type == DT_DIR && ii->visiting)
+			warnmsg("%s/%s: directory loop, not descending", path, d->name);
+		else if (d->type == DT_DIR) {
 			char *tmp;
-			tmp = xmalloc(BUFSIZ);
+			tmp = xmalloc(strlen(path) + d->nsize + 2);
 			sprintf(tmp, "%s/%s", path, d->name);
-			visit(o, size, tmp, verbose, visitor);
+			ii->visiting = 1;
+			visitdir(o, size, d->ino, tmp, verbose, visitor);
+			ii->visiting = 0;
 			free(tmp);
 		}
 
@@ -334,26 +842,20 @@ void visitdir(char *o, size_t size, struct dir *d, const char *path, int verbose
 	}
 }
 
-void do_print(char* imagebuf, size_t imagesize, struct dir *d, char m, struct jffs2_raw_inode *ri, uint32_t len, const char *path, int verbose)
+void do_print(char* imagebuf, size_t imagesize, uint32_t pino, struct dir *d, char m, struct inode_info *ii, uint32_t len, const char *path, int verbose)
 {
-	jint32_t mode;
-	time_t age;
+	time_t t = ii->ctime, age;
 	char *filetime;
 	
-    filetime = ctime((const time_t *) &(ri->ctime));
-    age = time(NULL) - je32_to_cpu(ri->ctime);
-    mode.v32 = ri->mode.m;
-    if(verbose) printf("%s %-4d %-8d %-8d ", mode_string(je32_to_cpu(mode)),
-            1, je16_to_cpu(ri->uid), je16_to_cpu(ri->gid));
+    filetime = ctime(&t);
+    age = time(NULL) - t;
+    if(verbose) printf("%s %-4d %-8u %-8u ", mode_string(ii->mode),
+            1, ii->uid, ii->gid);
     if ( d->type==DT_BLK || d->type==DT_CHR ) {
-        dev_t rdev;
-        size_t devsize;
-        putblock((char*)&rdev, sizeof(rdev), &devsize, ri);
-        if(verbose) printf("%4d, %3d ", major(rdev), minor(rdev));
+        if(verbose) printf("%4u, %3u ", major(ii->rdev), minor(ii->rdev));
     } else {
         if(verbose) printf("%9ld ", (long)len);
     }
-    d->name[d->nsize]='\0';
     if (verbose) {
         if (age < 3600L * 24 * 365 / 2 && age > -15 * 60)
             /* hh:mm if less than 6 months old */
@@ -363,502 +865,3471 @@ void do_print(char* imagebuf, size_t imagesize, struct dir *d, char m, struct jf
     }
     printf("%s%s%s%c", (path[0] == 0) ? "" : path+1, (path[0] == 0) ? "" : "/", d->name, m);
     if (d->type == DT_LNK) {
-        char symbuf[1024];
-        size_t symsize;
-        putblock(symbuf, sizeof(symbuf), &symsize, ri);
-        symbuf[symsize] = 0;
-        printf(" -> %s", symbuf);
+        char *target = read_symlink(&dec, imagebuf, ii);
+        if (target)
+            printf(" -> %s", target);
+        free(target);
     }
     printf("\n");
 }
 
-/* frees memory used by directory structure */
+/* orders node references by inode (or parent inode), then version */
 
-/*
-   d       - dir struct
- */
+static int cmp_node_ref(const void *a, const void *b)
+{
+	const struct node_ref *x = a, *y = b;
+	uint32_t kx, ky;
+
+	kx = x->type == JFFS2_NODETYPE_DIRENT ? x->pino : x->ino;
+	ky = y->type == JFFS2_NODETYPE_DIRENT ? y->pino : y->ino;
+
+	if (kx != ky)
+		return kx < ky ? -1 : 1;
+	if (x->version != y->version)
+		return x->version < y->version ? -1 : 1;
+	if (x->ofs != y->ofs)
+		return x->ofs < y->ofs ? -1 : 1;
+	return 0;
+}
 
-void freedir(struct dir *d)
+/* appends a reference, cleared so fields the scan does not set, like
+   flags, start out zero */
+
+static struct node_ref *add_node_ref(struct node_ref **refs, size_t *nrefs,
+		size_t *alloc)
 {
-	struct dir *t;
+	struct node_ref *r;
 
-	while (d != NULL) {
-		t = d->next;
-		free(d);
-		d = t;
+	if (*nrefs == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 1024;
+		*refs = xrealloc(*refs, *alloc * sizeof(struct node_ref));
 	}
+
+	r = &(*refs)[(*nrefs)++];
+	memset(r, 0, sizeof(*r));
+	return r;
+}
+
+/* hashes a (parent inode, name) pair. crc is the JFFS2 crc32 of the name,
+   so the name_crc stored in a dirent can be used without rehashing. */
+
+static inline uint32_t name_hash(uint32_t pino, uint32_t crc)
+{
+	return crc ^ (pino * 0x9e3779b1);
 }
 
-/* collects directory/file nodes in version order. */
+/* fills the (pino, name) hash with the newest dirent of every name. */
 
 /*
-   f       - file flag.
-   if zero, collect file, compare ino to inode
-   otherwise, collect directory, compare ino to parent inode
    o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - inode to compare against. see f.
-
-   return value: a jffs2_raw_inode that corresponds the the specified
-   inode, or NULL
  */
 
-struct jffs2_raw_inode *find_raw_inode(char *o, size_t size, uint32_t ino, 
-	uint32_t vcur)
+static void build_names(char *o)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-	union jffs2_node_union *lr;	/* last block position */
-	union jffs2_node_union *mp = NULL;	/* minimum position */
-
-	uint32_t vmin, vmint, vmaxt, vmax, v;
-
-	vmin = 0;					/* next to read */
-	vmax = ~((uint32_t) 0);		/* last to read */
-	vmint = ~((uint32_t) 0);
-	vmaxt = 0;					/* found maximum */
-
-	n = (union jffs2_node_union *) o;
-	lr = n;
+	struct jffs2_raw_dirent *n, *m;
+	struct name_slot *slot;
+	size_t i, j, mask;
+	uint32_t h;
+
+	idx.nslots = 16;
+	while (idx.nslots < idx.ndirents * 2)
+		idx.nslots *= 2;
+	idx.names = xzalloc(idx.nslots * sizeof(struct name_slot));
+	mask = idx.nslots - 1;
+
+	/* dirents are sorted by version, so a later one replaces an earlier */
+	for (i = 0; i < idx.ndirents; i++) {
+		n = &(NODE_AT(o, &idx.dirents[i])->d);
+		h = name_hash(idx.dirents[i].pino, idx.dirents[i].name_crc);
+
+		for (j = h & mask; ; j = (j + 1) & mask) {
+			slot = &idx.names[j];
+			if (slot->dirent == NULL)
+				break;
+			if (slot->hash != h || slot->dirent->pino != idx.dirents[i].pino)
+				continue;
+			m = &(NODE_AT(o, slot->dirent)->d);
+			if (m->nsize == n->nsize && !memcmp(m->name, n->name, n->nsize))
+				break;
+		}
 
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
-			ADD_BYTES(n, 4);
-
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_INODE &&
-				je32_to_cpu(n->i.ino) == ino && (v = je32_to_cpu(n->i.version)) > vcur) {
-				/* XXX crc check */
-
-				if (vmaxt < v)
-					vmaxt = v;
-				if (vmint > v) {
-					vmint = v;
-					mp = n;
-				}
-
-				if (v == (vcur + 1))
-					return (&(n->i));
-			}
+		if (slot->dirent == NULL || slot->dirent->version < idx.dirents[i].version) {
+			slot->hash = h;
+			slot->dirent = &idx.dirents[i];
+		}
+	}
+}
 
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			n = (union jffs2_node_union *) o;	/* we're at the end, rewind to the beginning */
+/* fills the inode to dirent map from the live entries of the name hash.
+   an inode with several links maps to the newest of them. */
 
-		if (lr == n) {			/* whole loop since last read */
-			vmax = vmaxt;
-			vmin = vmint;
-			vmint = ~((uint32_t) 0);
+static void build_links(void)
+{
+	struct ino_slot *slot;
+	struct node_ref *r;
+	size_t i, j, mask;
+
+	idx.nlinkslots = 16;
+	while (idx.nlinkslots < idx.ndirents * 2)
+		idx.nlinkslots *= 2;
+	idx.links = xzalloc(idx.nlinkslots * sizeof(struct ino_slot));
+	mask = idx.nlinkslots - 1;
+
+	for (i = 0; i < idx.nslots; i++) {
+		r = idx.names[i].dirent;
+		if (r == NULL || r->ino == 0)
+			continue;
 
-			if (vcur < vmax && vcur < vmin)
-				return (&(mp->i));
+		for (j = (r->ino * 0x9e3779b1) & mask; ; j = (j + 1) & mask) {
+			slot = &idx.links[j];
+			if (slot->dirent == NULL || slot->ino == r->ino)
+				break;
 		}
-	} while (vcur < vmax);
 
-	return NULL;
+		if (slot->dirent == NULL || slot->dirent->version < r->version) {
+			slot->ino = r->ino;
+			slot->dirent = r;
+		}
+	}
 }
 
-/* collects dir struct for selected inode */
+/* finds the next 16-bit word equal to magic at 4-byte alignment. */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   pino    - inode of the specified directory
-   d       - input directory structure
+   p       - where to start, 4-byte aligned
+   l       - where to stop
+   magic   - magic word as stored in the image
 
-   return value: result directory structure, replaces d.
+   return value: position of the magic word, or l if there is none
  */
 
-struct dir *collectdir(char *o, size_t size, uint32_t ino, struct dir *d)
+static char *find_magic_scalar(char *p, char *l, uint16_t magic)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-	union jffs2_node_union *lr;	/* last block position */
-	union jffs2_node_union *mp = NULL;	/* minimum position */
-
-	uint32_t vmin, vmint, vmaxt, vmax, vcur, v;
+	for (; p < l; p += 4)
+		if (*(uint16_t *) p == magic)
+			return p;
 
-	vmin = 0;					/* next to read */
-	vmax = ~((uint32_t) 0);		/* last to read */
-	vmint = ~((uint32_t) 0);
-	vmaxt = 0;					/* found maximum */
-	vcur = 0;					/* XXX what is smallest version number used? */
-	/* too low version number can easily result excess log rereading */
-
-	n = (union jffs2_node_union *) o;
-	lr = n;
-
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
-			ADD_BYTES(n, 4);
-
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_DIRENT &&
-				je32_to_cpu(n->d.pino) == ino && (v = je32_to_cpu(n->d.version)) > vcur) {
-				/* XXX crc check */
-
-				if (vmaxt < v)
-					vmaxt = v;
-				if (vmint > v) {
-					vmint = v;
-					mp = n;
-				}
-
-				if (v == (vcur + 1)) {
-					d = putdir(d, &(n->d));
-
-					lr = n;
-					vcur++;
-					vmint = ~((uint32_t) 0);
-				}
-			}
-
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			n = (union jffs2_node_union *) o;	/* we're at the end, rewind to the beginning */
+	return l;
+}
 
-		if (lr == n) {			/* whole loop since last read */
-			vmax = vmaxt;
-			vmin = vmint;
-			vmint = ~((uint32_t) 0);
+#ifdef HAVE_SSE2
+/* the words at 4-byte alignment are bits 0, 4, 8, ... of movemask */
+#define MAGIC_LANES 0x1111
 
-			if (vcur < vmax && vcur < vmin) {
-				d = putdir(d, &(mp->d));
+static char *find_magic_sse2(char *p, char *l, uint16_t magic)
+{
+	__m128i m = _mm_set1_epi16(magic), a, b, c, d;
+	uint64_t mask;
+
+	while (p + 64 <= l) {
+		a = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) p), m);
+		b = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (p + 16)), m);
+		c = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (p + 32)), m);
+		d = _mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (p + 48)), m);
+
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+						_mm_or_si128(c, d))) & MAGIC_LANES) {
+			mask = (uint64_t) (_mm_movemask_epi8(a) & MAGIC_LANES) |
+				(uint64_t) (_mm_movemask_epi8(b) & MAGIC_LANES) << 16 |
+				(uint64_t) (_mm_movemask_epi8(c) & MAGIC_LANES) << 32 |
+				(uint64_t) (_mm_movemask_epi8(d) & MAGIC_LANES) << 48;
+			return p + __builtin_ctzll(mask);
+		}
+		p += 64;
+	}
 
-				lr = n =
-					(union jffs2_node_union *) (((char *) mp) +
-							((je32_to_cpu(mp->u.totlen) + 3) & ~3));
+	return find_magic_scalar(p, l, magic);
+}
 
-				vcur = vmin;
-			}
+__attribute__((target("avx2")))
+static char *find_magic_avx2(char *p, char *l, uint16_t magic)
+{
+	__m256i m = _mm256_set1_epi16(magic), a, b;
+	uint64_t mask;
+
+	while (p + 64 <= l) {
+		a = _mm256_cmpeq_epi16(_mm256_loadu_si256((__m256i *) p), m);
+		b = _mm256_cmpeq_epi16(_mm256_loadu_si256((__m256i *) (p + 32)), m);
+
+		if (!_mm256_testz_si256(_mm256_or_si256(a, b),
+					_mm256_set1_epi32(0xffff))) {
+			mask = ((uint64_t) (uint32_t) _mm256_movemask_epi8(a) |
+					(uint64_t) (uint32_t) _mm256_movemask_epi8(b) << 32) &
+				0x1111111111111111ULL;
+			return p + __builtin_ctzll(mask);
 		}
-	} while (vcur < vmax);
+		p += 64;
+	}
 
-	return d;
+	return find_magic_scalar(p, l, magic);
 }
+#endif
 
+static char *(*find_magic)(char *, char *, uint16_t) = find_magic_scalar;
 
+/* picks the fastest magic word search the CPU supports */
 
-/* resolve dirent based on criteria */
+static void init_find_magic(void)
+{
+#ifdef HAVE_SSE2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		find_magic = find_magic_avx2;
+	else
+		find_magic = find_magic_sse2;
+#endif
+}
+
+/* skips erased flash, a cache line at a time where aligned. */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - if zero, ignore,
-   otherwise compare against dirent inode
-   pino    - if zero, ingore,
-   otherwise compare against parent inode
-   and use name and nsize as extra criteria
-   name    - name of wanted dirent, used if pino!=0
-   nsize   - length of name of wanted dirent, used if pino!=0
+   p       - where to start, 4-byte aligned
+   l       - where to stop
 
-   return value: pointer to relevant dirent structure in
-   filesystem image or NULL
+   return value: first 4-byte word that is not erased, or l
  */
 
-struct jffs2_raw_dirent *resolvedirent(char *o, size_t size,
-		uint32_t ino, uint32_t pino,
-		char *name, uint8_t nsize)
+static char *skip_erased(char *p, char *l)
 {
-	/* aligned! */
-	union jffs2_node_union *n;
-	union jffs2_node_union *e = (union jffs2_node_union *) (o + size);
-
-	struct jffs2_raw_dirent *dd = NULL;
+	uint64_t *q;
 
-	uint32_t vmax, v;
+	while (p + 4 <= l && ((uintptr_t) p & 63)) {
+		if (*(uint32_t *) p != 0xffffffff)
+			return p;
+		p += 4;
+	}
 
-	if (!pino && ino <= 1)
-		return dd;
+	for (q = (uint64_t *) p; (char *) (q + 8) <= l; q += 8)
+		if ((q[0] & q[1] & q[2] & q[3] & q[4] & q[5] & q[6] & q[7]) != ~0ULL)
+			break;
 
-	vmax = 0;
+	for (p = (char *) q; p + 4 <= l; p += 4)
+		if (*(uint32_t *) p != 0xffffffff)
+			return p;
 
-	n = (union jffs2_node_union *) o;
+	return l;
+}
 
-	do {
-		while (n < e && je16_to_cpu(n->u.magic) != JFFS2_MAGIC_BITMASK)
-			ADD_BYTES(n, 4);
-
-		if (n < e && je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK) {
-			if (je16_to_cpu(n->u.nodetype) == JFFS2_NODETYPE_DIRENT &&
-					(!ino || je32_to_cpu(n->d.ino) == ino) &&
-					(v = je32_to_cpu(n->d.version)) > vmax &&
-					(!pino || (je32_to_cpu(n->d.pino) == pino &&
-							   nsize == n->d.nsize &&
-							   !memcmp(name, n->d.name, nsize)))) {
-				/* XXX crc check */
-
-				if (vmax < v) {
-					vmax = v;
-					dd = &(n->d);
-				}
-			}
+static void add_extent(struct extent **ext, size_t *next, size_t *alloc,
+		uint32_t ofs, uint32_t len)
+{
+	if (*next && (*ext)[*next - 1].ofs + (*ext)[*next - 1].len == ofs) {
+		(*ext)[*next - 1].len += len;
+		return;
+	}
 
-			ADD_BYTES(n, ((je32_to_cpu(n->u.totlen) + 3) & ~3));
-		} else
-			return dd;
-	} while (1);
+	if (*next == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 64;
+		*ext = xrealloc(*ext, *alloc * sizeof(struct extent));
+	}
+	(*ext)[*next].ofs = ofs;
+	(*ext)[(*next)++].len = len;
 }
 
-/* resolve name under certain parent inode to dirent */
+/* nodes found by scanning one range of the image */
+struct scan_part {
+	char *o;					/* filesystem image pointer */
+	size_t size;				/* size of filesystem image */
+	size_t start, end;			/* range in which nodes are looked for */
+	size_t stop;				/* where the scan ended, may be past end */
+	struct node_ref *inodes;	/* sorted by ino, version */
+	size_t ninodes, ialloc;
+	struct node_ref *dirents;	/* sorted by pino, version */
+	size_t ndirents, dalloc;
+	struct extent *erased;		/* sorted by offset */
+	size_t nerased, ealloc;
+	unsigned long erasesize;	/* summaries are used if set */
+	size_t nblocks, nsumblocks, nbadcrc;
+	pthread_t thread;
+};
+
+#define JFFS2_SWAPPED 0
+#include "jffs2extract-nodes.h"
+#undef JFFS2_SWAPPED
+#define JFFS2_SWAPPED 1
+#include "jffs2extract-nodes.h"
+#undef JFFS2_SWAPPED
+
+/* decodes the data of a file node. */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   pino    - requested parent inode
-   name    - name of wanted dirent
-   nsize   - length of name of wanted dirent
+   dc      - decoder
+   n       - node
+   b       - output buffer, at least dsize bytes
 
-   return value: pointer to relevant dirent structure in
-   filesystem image or NULL
+   return value: 0 on success, -1 if the data could not be decoded
  */
 
-struct jffs2_raw_dirent *resolvename(char *o, size_t size, uint32_t pino,
-		char *name, uint8_t nsize)
+int decode_node(struct decoder *dc, struct jffs2_raw_inode *n, char *b)
 {
-	return resolvedirent(o, size, 0, pino, name, nsize);
+	if (target_endian == __BYTE_ORDER)
+		return decode_node_native(dc, n, b);
+	return decode_node_swapped(dc, n, b);
 }
 
-/* resolve inode to dirent */
+/* checks the node CRC of a raw inode node the first time its header
+   is used. */
 
 /*
+   dc      - decoder
    o       - filesystem image pointer
-   size    - size of filesystem image
+   r       - node
+
+   return value: 1 if the node has just been found bad, 0 otherwise
+ */
+
+static int check_header(struct decoder *dc, char *o, struct node_ref *r)
+{
+	if (target_endian == __BYTE_ORDER)
+		return check_header_native(dc, o, r);
+	return check_header_swapped(dc, o, r);
+}
+
+/* writes the live data of a file at its offsets in the output file. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   fd      - output file, opened for writing and empty
+
+   return value: 0 on success, -1 on write errors
+ */
+
+int putfile(struct decoder *dc, char *o, struct inode_info *ii, int fd)
+{
+	if (target_endian == __BYTE_ORDER)
+		return putfile_native(dc, o, ii, fd);
+	return putfile_swapped(dc, o, ii, fd);
+}
+
+/* works out which parts of which nodes make up a file. */
+
+/*
+   dc      - decoder, receives the fragments in dc->frags
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   isize   - result file size
+
+   return value: number of fragments
+ */
+
+size_t plan_file(struct decoder *dc, char *o, struct inode_info *ii,
+		uint32_t *isize)
+{
+	if (target_endian == __BYTE_ORDER)
+		return plan_file_native(dc, o, ii, isize);
+	return plan_file_swapped(dc, o, ii, isize);
+}
+
+/* sends fragments of a file to the output file. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   frags   - fragments from plan_file
+   nfrags  - number of fragments
+   out     - output file
+
+   return value: 0 on success, -1 on write errors
+ */
+
+int write_frags(struct decoder *dc, char *o, struct inode_info *ii,
+		const struct frag *frags, size_t nfrags, struct file_sink *out)
+{
+	if (target_endian == __BYTE_ORDER)
+		return write_frags_native(dc, o, ii, frags, nfrags, out);
+	return write_frags_swapped(dc, o, ii, frags, nfrags, out);
+}
+
+/* checks the node and data CRCs of a raw inode node the first time it
+   supplies data. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   r       - node
+
+   return value: 1 if the node has just been found bad, 0 otherwise
+ */
+
+static int check_node(struct decoder *dc, char *o, struct node_ref *r)
+{
+	if (target_endian == __BYTE_ORDER)
+		return check_node_native(dc, o, r);
+	return check_node_swapped(dc, o, r);
+}
+
+/* decodes the target of a symlink from the node the attributes of the
+   link come from, or the newest older one if its data turns out bad. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - the link inode
+
+   return value: the target, to be freed by the caller, or NULL if no
+   good node holds it
+ */
+
+char *read_symlink(struct decoder *dc, char *o, struct inode_info *ii)
+{
+	struct jffs2_raw_inode *n;
+	char *target;
+	uint32_t i, len;
+
+	for (i = ii->meta < ii->nnodes ? ii->meta + 1 : 0; i > 0; i--) {
+		check_node(dc, o, &ii->nodes[i - 1]);
+		if (!(ii->nodes[i - 1].flags & NODE_BAD))
+			break;
+	}
+	if (i == 0)
+		return NULL;
+
+	n = &(NODE_AT(o, &ii->nodes[i - 1])->i);
+	len = je32_to_cpu(n->dsize);
+	if (je32_to_cpu(n->offset) || len > PATH_MAX)
+		return NULL;
+
+	target = xmalloc(len + 1);
+	if (decode_node(dc, n, target)) {
+		free(target);
+		return NULL;
+	}
+	if (je32_to_cpu(n->isize) < len)
+		len = je32_to_cpu(n->isize);
+	target[len] = '\0';
+
+	return target;
+}
+
+/* finds the byte order of an image from the first node with a valid
+   header CRC, read either way. */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+
+   return value: __LITTLE_ENDIAN or __BIG_ENDIAN, the host byte order
+   if no valid node is found
+ */
+
+int detect_endian(char *o, size_t size)
+{
+	struct jffs2_unknown_node *n;
+	char *p = o, *e = o + (size & ~(size_t) 3);
+	int swapped;
+
+	while (p + sizeof(*n) <= e) {
+		if (*(uint32_t *) p == 0xffffffff) {
+			p = skip_erased(p, e);
+			continue;
+		}
+
+		n = (struct jffs2_unknown_node *) p;
+		if (n->magic.v16 == JFFS2_MAGIC_BITMASK)
+			swapped = 0;
+		else if (n->magic.v16 == KSAMTIB_CIGAM_2SFFJ)
+			swapped = 1;
+		else {
+			p += 4;
+			continue;
+		}
+
+		if (jffs2_crc32(0, n, sizeof(*n) - 4) ==
+				(swapped ? bswap_32(n->hdr_crc.v32) : n->hdr_crc.v32)) {
+			if (!swapped)
+				return __BYTE_ORDER;
+			return __BYTE_ORDER == __LITTLE_ENDIAN ? __BIG_ENDIAN : __LITTLE_ENDIAN;
+		}
+		p += 4;
+	}
+
+	return __BYTE_ORDER;
+}
+
+/* drops references to nodes that start inside a node found by the
+   previous part. happens only if a part boundary is not an erase block
+   boundary, e.g. with a guessed erase block size. */
+
+static size_t drop_overlap(struct node_ref *refs, size_t nrefs, size_t before)
+{
+	size_t i, j;
+
+	for (i = j = 0; i < nrefs; i++)
+		if (refs[i].ofs >= before)
+			refs[j++] = refs[i];
+
+	return j;
+}
+
+/* merges sorted reference arrays of all parts into one sorted array.
+   a heap of the arrays, ordered by their first reference, yields the
+   next reference in O(log parts). */
+
+/*
+   runs    - sorted arrays, one per part
+   lens    - array lengths, consumed
+   nruns   - number of arrays
+   out     - result array
+   nout    - result length
+ */
+
+static void merge_runs(struct node_ref **runs, size_t *lens, int nruns,
+		struct node_ref **out, size_t *nout)
+{
+	struct node_ref *m;
+	size_t total = 0;
+	int *heap, nheap = 0, i, c, r;
+
+	for (r = 0; r < nruns; r++)
+		total += lens[r];
+
+	m = *out = xmalloc(total * sizeof(struct node_ref));
+	*nout = total;
+
+	heap = xmalloc(nruns * sizeof(int));
+	for (r = 0; r < nruns; r++) {
+		if (!lens[r])
+			continue;
+		for (i = nheap++; i > 0 && cmp_node_ref(runs[r], runs[heap[(i - 1) / 2]]) < 0;
+				i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = r;
+	}
+
+	while (nheap) {
+		r = heap[0];
+		*m++ = *runs[r]++;
+		/* an exhausted array is replaced by the last one in the heap */
+		if (!--lens[r]) {
+			r = heap[--nheap];
+			if (!nheap)
+				break;
+		}
+
+		for (i = 0; (c = 2 * i + 1) < nheap; i = c) {
+			if (c + 1 < nheap && cmp_node_ref(runs[heap[c + 1]], runs[heap[c]]) < 0)
+				c++;
+			if (cmp_node_ref(runs[heap[c]], runs[r]) >= 0)
+				break;
+			heap[i] = heap[c];
+		}
+		heap[i] = r;
+	}
+
+	free(heap);
+}
+
+/* guesses the erase block size of an image: the smallest power of two
+   from 4 KiB up at whose every multiple there is a node or erased flash.
+   a too small guess only costs some rescanning at part boundaries and
+   unused summaries, so the end of a summarised block is looked for
+   first. */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+
+   return value: erase block size, zero if none fits
+ */
+
+unsigned long detect_erase_size(char *o, size_t size)
+{
+	union jffs2_node_union *n;
+	struct jffs2_sum_marker *sm;
+	unsigned long es;
+	size_t ofs, nodes;
+
+	/* a summary marker at the end of the first block is conclusive */
+	for (es = 4096; es <= 1024 * 1024 && size >= es; es *= 2) {
+		sm = (struct jffs2_sum_marker *) (o + es - sizeof(*sm));
+		if (je32_to_cpu(sm->magic) == JFFS2_SUM_MAGIC &&
+				je32_to_cpu(sm->offset) < es)
+			return es;
+	}
+
+	for (es = 4096; es <= 1024 * 1024 && size >= 2 * es; es *= 2) {
+		nodes = 0;
+
+		for (ofs = 0; ofs + sizeof(struct jffs2_unknown_node) <= size; ofs += es) {
+			n = (union jffs2_node_union *) (o + ofs);
+			if (je16_to_cpu(n->u.magic) == JFFS2_MAGIC_BITMASK)
+				nodes++;
+			else if (n->u.totlen.v32 != 0xffffffff || n->u.magic.v16 != 0xffff)
+				break;
+		}
+
+		if (ofs + sizeof(struct jffs2_unknown_node) > size && nodes)
+			return es;
+	}
+
+	return 0;
+}
+
+/* reads the device number of a device file node, stored as the old 16
+   bit or the new 32 bit encoding. */
+
+/*
+   n       - newest node of the device file
+
+   return value: device number, zero if there is none
+ */
+
+static dev_t decode_rdev(struct jffs2_raw_inode *n)
+{
+	union { jint16_t old_id; jint32_t new_id; } jdev;
+	uint32_t dsize = je32_to_cpu(n->dsize), id;
+
+	if (dsize != sizeof(jdev.old_id) && dsize != sizeof(jdev.new_id))
+		return 0;
+
+	if (n->compr == JFFS2_COMPR_NONE && je32_to_cpu(n->csize) >= dsize)
+		memcpy(&jdev, n->data, dsize);
+	else if (decode_node(&dec, n, (char *) &jdev))
+		return 0;
+
+	if (dsize == sizeof(jdev.old_id)) {
+		id = je16_to_cpu(jdev.old_id);
+		return makedev(id >> 8, id & 0xff);
+	}
+
+	id = je32_to_cpu(jdev.new_id);
+	return makedev((id & 0xfff00) >> 8, (id & 0xff) | ((id >> 12) & 0xfff00));
+}
+
+/* sets the attributes of an inode from its newest node with a good
+   header, so listings need not look at the nodes again. the data CRC
+   is left to the paths that use the data. an inode without such a node
+   is left without attributes. */
+
+/*
+   o       - filesystem image pointer
+   ii      - inode with its nodes in version order
+ */
+
+static void fill_meta(char *o, struct inode_info *ii)
+{
+	struct jffs2_raw_inode *n;
+	uint32_t i;
+
+	for (i = ii->nnodes; i > 0; i--) {
+		check_header(&dec, o, &ii->nodes[i - 1]);
+		if (!(ii->nodes[i - 1].flags & NODE_BAD))
+			break;
+	}
+	ii->meta = i ? i - 1 : ii->nnodes;
+	if (i == 0) {
+		ii->version = ii->isize = ii->mode = 0;
+		ii->uid = ii->gid = 0;
+		ii->mtime = ii->ctime = 0;
+		ii->rdev = 0;
+		return;
+	}
+
+	n = &(NODE_AT(o, &ii->nodes[i - 1])->i);
+	ii->version = je32_to_cpu(n->version);
+	ii->isize = je32_to_cpu(n->isize);
+	ii->mode = jemode_to_cpu(n->mode);
+	ii->uid = je16_to_cpu(n->uid);
+	ii->gid = je16_to_cpu(n->gid);
+	ii->mtime = je32_to_cpu(n->mtime);
+	ii->ctime = je32_to_cpu(n->ctime);
+	ii->rdev = S_ISCHR(ii->mode) || S_ISBLK(ii->mode) ? decode_rdev(n) : 0;
+}
+
+/* scans the image once, recording every INODE and DIRENT node. with
+   several threads, the image is split at erase block boundaries and
+   every part is scanned and sorted on its own thread before the parts
+   are merged. */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   nthreads - number of scan threads
+   erasesize - erase block size, zero to guess it
+ */
+
+void build_index(char *o, size_t size, int nthreads, unsigned long erasesize)
+{
+	struct scan_part *parts;
+	struct node_ref **runs;
+	struct inode_info *ii = NULL;
+	size_t i, nblocks = 0, nalloc = 0, ealloc = 0, *lens;
+	void *(*scan)(void *);
+	int k, nparts = 1;
+
+	if (size > UINT32_MAX)
+		errmsg_die("Image too large (%zu bytes)", size);
+
+	free_index();
+	init_find_magic();
+	scan = target_endian == __BYTE_ORDER ? scan_part_native : scan_part_swapped;
+
+	if (!erasesize && (nthreads > 1 || use_summary))
+		erasesize = detect_erase_size(o, size);
+	if (erasesize)
+		nblocks = (size + erasesize - 1) / erasesize;
+	if (nthreads > 1)
+		nparts = nblocks < (size_t) nthreads ? (nblocks ? nblocks : 1) : (size_t) nthreads;
+
+	parts = xzalloc(nparts * sizeof(struct scan_part));
+	for (k = 0; k < nparts; k++) {
+		parts[k].o = o;
+		parts[k].size = size;
+		parts[k].erasesize = use_summary ? erasesize : 0;
+		parts[k].start = nparts == 1 ? 0 : nblocks * k / nparts * erasesize;
+		parts[k].end = nparts == 1 ? size :
+			MIN(size, nblocks * (k + 1) / nparts * erasesize);
+	}
+
+	if (nparts == 1)
+		scan(&parts[0]);
+	else {
+		for (k = 0; k < nparts; k++)
+			if (pthread_create(&parts[k].thread, NULL, scan, &parts[k]))
+				sys_errmsg_die("Unable to start scan thread");
+		for (k = 0; k < nparts; k++)
+			pthread_join(parts[k].thread, NULL);
+	}
+
+	runs = xmalloc(nparts * sizeof(struct node_ref *));
+	lens = xmalloc(nparts * sizeof(size_t));
+
+	for (k = 1; k < nparts; k++) {
+		if (parts[k - 1].stop <= parts[k].start)
+			continue;
+		parts[k].ninodes = drop_overlap(parts[k].inodes, parts[k].ninodes,
+				parts[k - 1].stop);
+		parts[k].ndirents = drop_overlap(parts[k].dirents, parts[k].ndirents,
+				parts[k - 1].stop);
+		if (parts[k].stop < parts[k - 1].stop)
+			parts[k].stop = parts[k - 1].stop;
+	}
+
+	for (k = 0; k < nparts; k++) {
+		runs[k] = parts[k].inodes;
+		lens[k] = parts[k].ninodes;
+	}
+	merge_runs(runs, lens, nparts, &idx.inodes, &idx.ninodes);
+
+	for (k = 0; k < nparts; k++) {
+		runs[k] = parts[k].dirents;
+		lens[k] = parts[k].ndirents;
+	}
+	merge_runs(runs, lens, nparts, &idx.dirents, &idx.ndirents);
+
+	idx.erasesize = erasesize;
+	idx.size = size;
+	for (k = 0; k < nparts; k++) {
+		idx.nblocks += parts[k].nblocks;
+		idx.nsumblocks += parts[k].nsumblocks;
+		idx.nbadcrc += parts[k].nbadcrc;
+	}
+
+	/* parts are in image order, so their erased extents are too */
+	for (k = 0; k < nparts; k++) {
+		for (i = 0; i < parts[k].nerased; i++)
+			if (k == 0 || parts[k].erased[i].ofs >= parts[k - 1].stop)
+				add_extent(&idx.erased, &idx.nerased, &ealloc,
+						parts[k].erased[i].ofs, parts[k].erased[i].len);
+		free(parts[k].erased);
+	}
+
+	for (k = 0; k < nparts; k++) {
+		free(parts[k].inodes);
+		free(parts[k].dirents);
+	}
+	free(lens);
+	free(runs);
+	free(parts);
+
+	/* split the sorted inode nodes into one version list per inode */
+	for (i = 0; i < idx.ninodes; i++) {
+		if (i == 0 || idx.inodes[i].ino != idx.inodes[i - 1].ino) {
+			if (idx.ninos == nalloc) {
+				nalloc = nalloc ? nalloc * 2 : 1024;
+				idx.inos = xrealloc(idx.inos, nalloc * sizeof(struct inode_info));
+			}
+			ii = &idx.inos[idx.ninos++];
+			ii->ino = idx.inodes[i].ino;
+			ii->nnodes = 0;
+			ii->nodes = &idx.inodes[i];
+			ii->visiting = 0;
+		}
+		ii->nnodes++;
+	}
+
+	for (i = 0; i < idx.ninos; i++)
+		fill_meta(o, &idx.inos[i]);
+
+	build_names(o);
+	build_links();
+	build_tree(o);
+}
+
+/* frees memory used by the node index */
+
+void free_index(void)
+{
+	free(idx.inodes);
+	free(idx.inos);
+	free(idx.dirents);
+	free(idx.names);
+	free(idx.links);
+	free(idx.erased);
+	memset(&idx, 0, sizeof(idx));
+	free_tree();
+}
+
+/* finds the version list of an inode */
+
+/*
+   ino     - inode to look up
+
+   return value: the inode's raw inode nodes in version order, or NULL
+ */
+
+struct inode_info *lookup_inode(uint32_t ino)
+{
+	size_t lo = 0, hi = idx.ninos, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (idx.inos[mid].ino == ino)
+			return &idx.inos[mid];
+		if (idx.inos[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/* finds the first reference in a sorted array with key >= key
+   and version > vcur. */
+
+/*
+   refs    - sorted node references
+   nrefs   - number of references
+   key     - inode (INODE refs) or parent inode (DIRENT refs)
+   vcur    - version to start after
+
+   return value: index of the reference, nrefs if there is none
+ */
+
+static size_t lookup_node_ref(struct node_ref *refs, size_t nrefs,
+		uint32_t key, uint32_t vcur)
+{
+	size_t lo = 0, hi = nrefs, mid;
+	uint32_t k;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = refs[mid].type == JFFS2_NODETYPE_DIRENT ?
+			refs[mid].pino : refs[mid].ino;
+
+		if (k < key || (k == key && refs[mid].version <= vcur))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* finds the newest dirent of a name in a directory */
+
+/*
+   o       - filesystem image pointer
+   pino    - parent inode
+   name    - name of wanted dirent
+   nsize   - length of name of wanted dirent
+
+   return value: reference to the dirent with the highest version,
+   or NULL
+ */
+
+struct node_ref *lookup_name(char *o, uint32_t pino, const char *name,
+		uint8_t nsize)
+{
+	struct jffs2_raw_dirent *m;
+	struct name_slot *slot;
+	size_t j, mask = idx.nslots - 1;
+	uint32_t h;
+
+	if (!idx.nslots)
+		return NULL;
+
+	h = name_hash(pino, jffs2_crc32(0, name, nsize));
+
+	for (j = h & mask; idx.names[j].dirent != NULL; j = (j + 1) & mask) {
+		slot = &idx.names[j];
+		if (slot->hash != h || slot->dirent->pino != pino)
+			continue;
+		m = &(NODE_AT(o, slot->dirent)->d);
+		if (m->nsize == nsize && !memcmp(m->name, name, nsize))
+			return slot->dirent;
+	}
+
+	return NULL;
+}
+
+/* finds the newest live dirent of an inode */
+
+/*
+   ino     - inode to look up
+
+   return value: reference to the dirent, or NULL if the inode
+   is not linked anywhere
+ */
+
+struct node_ref *lookup_link(uint32_t ino)
+{
+	size_t j, mask = idx.nlinkslots - 1;
+
+	if (!idx.nlinkslots)
+		return NULL;
+
+	for (j = (ino * 0x9e3779b1) & mask; idx.links[j].dirent != NULL;
+			j = (j + 1) & mask)
+		if (idx.links[j].ino == ino)
+			return idx.links[j].dirent;
+
+	return NULL;
+}
+
+/* finds the raw inode node following a given version. */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   ino     - inode to look up
+   vcur    - version to start after, zero for the first one
+
+   return value: a jffs2_raw_inode of the specified inode with the
+   lowest version above vcur, or NULL
+ */
+
+struct jffs2_raw_inode *find_raw_inode(char *o, size_t size, uint32_t ino, 
+	uint32_t vcur)
+{
+	size_t i;
+
+	i = lookup_node_ref(idx.inodes, idx.ninodes, ino, vcur);
+	if (i == idx.ninodes || idx.inodes[i].ino != ino)
+		return NULL;
+
+	return &(NODE_AT(o, &idx.inodes[i])->i);
+}
+
+/* resolve dirent based on criteria */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   ino     - if zero, ignore,
+   otherwise compare against dirent inode
+   pino    - if zero, ingore,
+   otherwise compare against parent inode
+   and use name and nsize as extra criteria
+   name    - name of wanted dirent, used if pino!=0
+   nsize   - length of name of wanted dirent, used if pino!=0
+
+   return value: pointer to relevant dirent structure in
+   filesystem image or NULL
+ */
+
+struct jffs2_raw_dirent *resolvedirent(char *o, size_t size,
+		uint32_t ino, uint32_t pino,
+		char *name, uint8_t nsize)
+{
+	struct jffs2_raw_dirent *dd = NULL;
+	struct node_ref *r;
+
+	if (!pino && ino <= 1)
+		return dd;
+
+	if (pino) {
+		r = lookup_name(o, pino, name, nsize);
+		if (r == NULL || (ino && r->ino != ino))
+			return dd;
+
+		return &(NODE_AT(o, r)->d);
+	}
+
+	r = lookup_link(ino);
+
+	return r != NULL ? &(NODE_AT(o, r)->d) : dd;
+}
+
+/* resolve name under certain parent inode to dirent */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   pino    - requested parent inode
+   name    - name of wanted dirent
+   nsize   - length of name of wanted dirent
+
+   return value: pointer to relevant dirent structure in
+   filesystem image or NULL
+ */
+
+struct jffs2_raw_dirent *resolvename(char *o, size_t size, uint32_t pino,
+		char *name, uint8_t nsize)
+{
+	return resolvedirent(o, size, 0, pino, name, nsize);
+}
+
+/* resolve inode to dirent */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
    ino     - compare against dirent inode
 
-   return value: pointer to relevant dirent structure in
-   filesystem image or NULL
- */
+   return value: pointer to the newest live dirent of the inode in
+   filesystem image or NULL
+ */
+
+struct jffs2_raw_dirent *resolveinode(char *o, size_t size, uint32_t ino)
+{
+	return resolvedirent(o, size, ino, 0, NULL, 0);
+}
+
+/* resolve slash-style path into dirent and inode.
+   slash as first byte marks absolute path (root=inode 1).
+   . and .. are resolved properly, and symlinks are followed.
+ */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   ino     - root inode, used if path is relative
+   p       - path to be resolved
+   inos    - result inode, zero if failure
+   recc    - recursion count, to detect symlink loops
+
+   return value: pointer to dirent struct in file system image.
+   note that root directory doesn't have dirent struct
+   (return value is NULL), but it has inode (*inos=1)
+ */
+
+struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
+		const char *p, uint32_t * inos, int recc)
+{
+	struct jffs2_raw_dirent *dir = NULL;
+
+	int d = 1;
+	uint32_t tino;
+
+	char *next;
+
+	char *path, *pp;
+
+	char symbuf[1024];
+	size_t symsize = 0;
+
+	if (recc > 16) {
+		/* probably symlink loop */
+		*inos = 0;
+		return NULL;
+	}
+
+	pp = path = strdup(p);
+
+	if (*path == '/') {
+		path++;
+		ino = 1;
+	}
+
+	if (ino > 1) {
+		dir = resolveinode(o, size, ino);
+
+		ino = DIRENT_INO(dir);
+	}
+
+	next = path - 1;
+
+	while (ino && next != NULL && next[1] != 0 && d) {
+		path = next + 1;
+		next = strchr(path, '/');
+
+		if (next != NULL)
+			*next = 0;
+
+		if (*path == '.' && path[1] == 0)
+			continue;
+		if (*path == '.' && path[1] == '.' && path[2] == 0) {
+			if (DIRENT_PINO(dir) == 1) {
+				ino = 1;
+				dir = NULL;
+			} else {
+				dir = resolveinode(o, size, DIRENT_PINO(dir));
+				ino = DIRENT_INO(dir);
+			}
+
+			continue;
+		}
+
+		dir = resolvename(o, size, ino, path, (uint8_t) strlen(path));
+
+		if (DIRENT_INO(dir) == 0 ||
+				(next != NULL &&
+				 !(dir->type == DT_DIR || dir->type == DT_LNK))) {
+			free(pp);
+
+			*inos = 0;
+
+			return NULL;
+		}
+
+		if (dir->type == DT_LNK) {
+			struct jffs2_raw_inode *ri;
+			ri = find_raw_inode(o, size, DIRENT_INO(dir), 0);
+			putblock(&dec, symbuf, sizeof(symbuf), &symsize, ri);
+			symbuf[symsize] = 0;
+
+			tino = ino;
+			ino = 0;
+
+			dir = resolvepath0(o, size, tino, symbuf, &ino, ++recc);
+
+			if (dir != NULL && next != NULL &&
+					!(dir->type == DT_DIR || dir->type == DT_LNK)) {
+				free(pp);
+
+				*inos = 0;
+				return NULL;
+			}
+		}
+		if (dir != NULL)
+			ino = DIRENT_INO(dir);
+	}
+
+	free(pp);
+
+	*inos = ino;
+
+	return dir;
+}
+
+/* resolve slash-style path into dirent and inode.
+   slash as first byte marks absolute path (root=inode 1).
+   . and .. are resolved properly, and symlinks are followed.
+ */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   ino     - root inode, used if path is relative
+   p       - path to be resolved
+   inos    - result inode, zero if failure
+
+   return value: pointer to dirent struct in file system image.
+   note that root directory doesn't have dirent struct
+   (return value is NULL), but it has inode (*inos=1)
+ */
+
+struct jffs2_raw_dirent *resolvepath(char *o, size_t size, uint32_t ino,
+		const char *p, uint32_t * inos)
+{
+	return resolvepath0(o, size, ino, p, inos, 0);
+}
+
+/* lists files on directory specified by path */
+
+/*
+   o       - filesystem image pointer
+   size    - size of filesystem image
+   p       - path to be resolved
+ */
+
+void visit(char *o, size_t size, const char *path, int verbose, visitor visitor)
+{
+	struct jffs2_raw_dirent *dd;
+
+	uint32_t ino;
+	dd = resolvepath(o, size, 1, path ? path : "/", &ino);
+
+	if (ino == 0 ||
+			(dd == NULL && ino == 0) || (dd != NULL && dd->type != DT_DIR))
+		errmsg_die("%s: No such file or directory", path ? path : "/");
+
+	visitdir(o, size, ino, path, verbose, visitor);
+}
+
+/* directory created by extraction. entries are created relative to
+   its descriptor, so the kernel does not walk the whole path again for
+   each one, and paths may be longer than PATH_MAX. descriptors are
+   opened on demand and closed least recently used first. */
+struct dir_handle {
+	struct dir_handle *parent;	/* NULL for the directory extracted into */
+	const char *name;			/* interned, relative to parent */
+	int fd;						/* -1 while closed */
+	int refs;					/* users of fd, not closed while set */
+	struct dir_handle *prev, *next;	/* open handles, most recent first */
+	struct dir_handle *all;		/* every handle, for freeing */
+};
+
+/* hash slot mapping a directory inode to where it was extracted */
+struct handle_slot {
+	uint32_t ino;
+	struct dir_handle *h;		/* NULL if the slot is free */
+};
+
+/* open directory descriptors kept for reuse */
+#define MAX_DIR_FDS 64
+
+static struct {
+	pthread_mutex_t lock;		/* protects fds and the LRU list */
+	struct dir_handle *lru, *lru_tail;
+	int nopen;
+	struct dir_handle *all;
+	struct dir_handle *top;		/* the directory extracted into */
+	struct handle_slot *slots;	/* used by the tree walk only */
+	size_t nslots, nused;		/* power of two */
+	uint64_t hits, opens;
+} handles = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct dir_handle *new_handle(struct dir_handle *parent, const char *name)
+{
+	struct dir_handle *h = xzalloc(sizeof(*h));
+
+	h->parent = parent;
+	h->name = name;
+	h->fd = -1;
+	h->all = handles.all;
+	handles.all = h;
+
+	return h;
+}
+
+static void lru_unlink(struct dir_handle *h)
+{
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		handles.lru = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		handles.lru_tail = h->prev;
+	h->prev = h->next = NULL;
+}
+
+static void lru_front(struct dir_handle *h)
+{
+	h->next = handles.lru;
+	if (h->next)
+		h->next->prev = h;
+	else
+		handles.lru_tail = h;
+	handles.lru = h;
+}
+
+/* opens the descriptor of a handle, and those of its parents as
+   needed, with the lock held */
+
+static int open_handle(struct dir_handle *h)
+{
+	struct dir_handle *v;
+	int pfd = AT_FDCWD;
+
+	if (h->fd >= 0) {
+		handles.hits++;
+		lru_unlink(h);
+		lru_front(h);
+		return h->fd;
+	}
+
+	if (h->parent) {
+		pfd = open_handle(h->parent);
+		if (pfd < 0)
+			return -1;
+		h->parent->refs++;
+	}
+	h->fd = openat(pfd, h->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (h->parent)
+		h->parent->refs--;
+	if (h->fd < 0)
+		return -1;
+
+	handles.opens++;
+	handles.nopen++;
+	lru_front(h);
+
+	/* descriptors in use stay open, even beyond the limit */
+	for (v = handles.lru_tail; v && handles.nopen > MAX_DIR_FDS; ) {
+		struct dir_handle *prev = v->prev;
+
+		if (!v->refs && v != h) {
+			close(v->fd);
+			v->fd = -1;
+			lru_unlink(v);
+			handles.nopen--;
+		}
+		v = prev;
+	}
+
+	return h->fd;
+}
+
+/* returns the descriptor of a directory, keeping it open until
+   put_dirfd is called */
+
+/*
+   h       - directory
+
+   return value: descriptor, -1 with errno set if it cannot be opened
+ */
+
+static int get_dirfd(struct dir_handle *h)
+{
+	int fd;
+
+	pthread_mutex_lock(&handles.lock);
+	fd = open_handle(h);
+	if (fd >= 0)
+		h->refs++;
+	pthread_mutex_unlock(&handles.lock);
+
+	return fd;
+}
+
+static void put_dirfd(struct dir_handle *h)
+{
+	pthread_mutex_lock(&handles.lock);
+	h->refs--;
+	pthread_mutex_unlock(&handles.lock);
+}
+
+/* builds the path of an entry relative to the directory extracted
+   into, for messages */
+
+/*
+   h       - directory of the entry
+   name    - entry name
+
+   return value: allocated path
+ */
+
+static char *handle_path(struct dir_handle *h, const char *name)
+{
+	struct dir_handle *v;
+	size_t len = strlen(name) + 1, ofs;
+	char *p;
+
+	for (v = h; v->parent; v = v->parent)
+		len += strlen(v->name) + 1;
+
+	p = xmalloc(len);
+	ofs = len - strlen(name) - 1;
+	strcpy(p + ofs, name);
+	for (v = h; v->parent; v = v->parent) {
+		p[--ofs] = '/';
+		ofs -= strlen(v->name);
+		memcpy(p + ofs, v->name, strlen(v->name));
+	}
+
+	return p;
+}
+
+/* finds the slot of a directory inode in the handle hash */
+
+static struct handle_slot *handle_slot(uint32_t ino)
+{
+	size_t h;
+
+	for (h = (ino * 0x9e3779b1) & (handles.nslots - 1);
+			handles.slots[h].h && handles.slots[h].ino != ino;
+			h = (h + 1) & (handles.nslots - 1))
+		;
+
+	return &handles.slots[h];
+}
+
+/* records where a directory inode was extracted. a directory reached
+   again by another name in a corrupt image moves there. */
+
+static void set_handle(uint32_t ino, struct dir_handle *h)
+{
+	struct handle_slot *old = handles.slots, *s;
+	size_t i, nold = handles.nslots;
+
+	if (2 * (handles.nused + 1) > handles.nslots) {
+		handles.nslots = nold ? nold * 2 : 256;
+		handles.slots = xzalloc(handles.nslots * sizeof(struct handle_slot));
+		for (i = 0; i < nold; i++)
+			if (old[i].h)
+				*handle_slot(old[i].ino) = old[i];
+		free(old);
+	}
+
+	s = handle_slot(ino);
+	if (!s->h)
+		handles.nused++;
+	s->ino = ino;
+	s->h = h;
+}
+
+/* finds the handle of the directory an entry is extracted into. the
+   directory a listing starts from has no handle yet: it and its parents
+   are created below the current directory, following the path. */
+
+/*
+   pino    - inode of the directory
+   path    - its path in the image, as passed to the visitor
+
+   return value: handle
+ */
+
+static struct dir_handle *lookup_handle(uint32_t pino, const char *path)
+{
+	struct handle_slot *s;
+	struct dir_handle *h;
+	const char *p, *e, *name;
+	int dfd;
+
+	if (handles.nslots && (s = handle_slot(pino))->h)
+		return s->h;
+
+	if (!handles.top)
+		handles.top = new_handle(NULL, ".");
+
+	for (h = handles.top, p = path; *p; p = e) {
+		while (*p == '/')
+			p++;
+		for (e = p; *e && *e != '/'; e++)
+			;
+		if (e == p)
+			break;
+
+		/* resolvepath found the path, so components are names */
+		name = intern(p, e - p, jffs2_crc32(0, p, e - p));
+
+		dfd = get_dirfd(h);
+		if (dfd >= 0) {
+			if (mkdirat(dfd, name, 0777) && errno != EEXIST)
+				warnmsg("Failed to create %.*s: %s", (int) (e - path),
+						path, strerror(errno));
+			put_dirfd(h);
+		}
+		h = new_handle(h, name);
+	}
+
+	set_handle(pino, h);
+	return h;
+}
+
+/* closes all directory descriptors and forgets the handles */
+
+void free_handles(void)
+{
+	struct dir_handle *h, *next;
+
+	for (h = handles.all; h; h = next) {
+		next = h->all;
+		if (h->fd >= 0)
+			close(h->fd);
+		free(h);
+	}
+	free(handles.slots);
+	handles.all = handles.top = handles.lru = handles.lru_tail = NULL;
+	handles.slots = NULL;
+	handles.nslots = handles.nused = 0;
+	handles.nopen = 0;
+}
+
+/* file being extracted by the pool. a large file is written by several
+   range tasks sharing the descriptor, and with I/O threads by the
+   batches its data is sent in. the last of them to finish closes it. */
+struct extract_job {
+	struct dir_handle *dir;		/* directory the file is created in */
+	const char *name;			/* interned */
+	struct inode_info *ii;
+	int fd;
+	struct frag *frags;			/* grouped by node, NULL until planned */
+	size_t nfrags;
+	uint32_t isize;
+	off_t end;					/* end of the data written so far */
+	int pending;				/* range tasks and batches not finished */
+	int err;					/* errno of the first failure */
+};
+
+/* unit of work: a file to open and plan, or a range of its fragments */
+struct extract_task {
+	struct extract_job *job;
+	size_t from, to;			/* range of job->frags once planned */
+};
+
+/* deque of tasks. the owning worker pushes and pops at the tail, idle
+   workers steal from the head, so stolen work is the oldest and
+   largest. */
+struct task_deque {
+	pthread_mutex_t lock;
+	struct extract_task *tasks;	/* ring buffer */
+	size_t head, count, alloc;	/* alloc is a power of two */
+};
+
+/* piece of a file in a write batch */
+struct write_extent {
+	const char *data;			/* in the image or the batch buffer */
+	uint32_t len;
+	off_t ofs;
+};
+
+/* decoded data of one file on its way from a decode worker to an I/O
+   thread. batches are allocated once and recycled, which caps the
+   memory used for data in flight. */
+struct write_batch {
+	struct extract_job *job;
+	char *buf;					/* decoded node data */
+	size_t used, alloc;
+	struct write_extent *extents;
+	size_t nextents, extalloc;
+	size_t bytes;				/* sum of extent lengths */
+	off_t end;
+};
+
+/* bounded multi-producer multi-consumer queue of pointers. the fast
+   path is lock free; a consumer that finds the queue empty sleeps on
+   the condition variable until a producer sees it waiting. */
+struct ring_cell {
+	size_t seq;
+	void *data;
+};
+
+struct ring {
+	struct ring_cell *cells;
+	size_t mask;				/* capacity - 1, a power of two */
+	size_t head __attribute__((aligned(64)));	/* next push */
+	size_t tail __attribute__((aligned(64)));	/* next pop */
+	int waiters __attribute__((aligned(64)));
+	int closed;
+	uint64_t waits;				/* pops that had to sleep */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* where a decode worker sends file data when I/O threads write it */
+struct batch_sink {
+	struct file_sink s;
+	struct extract_job *job;
+	struct write_batch *b;		/* batch being filled, owned by the worker */
+};
+
+struct extract_worker {
+	pthread_t thread;
+	int id;
+	struct decoder dc;
+	struct task_deque q;
+	struct batch_sink out;
+};
+
+/* extraction pipeline: the main thread walks the tree, creating
+   directories before queueing their files; decode workers plan and
+   decode files; I/O threads, if any, write the decoded batches. */
+struct extract_pool {
+	char *o;					/* filesystem image pointer */
+	struct extract_worker *workers;
+	int nworkers;
+	int next;					/* deque receiving the next file */
+	pthread_mutex_t lock;		/* protects the counts below */
+	pthread_cond_t cond;		/* work queued, or all done */
+	pthread_cond_t space;		/* room for another file */
+	size_t queued;				/* tasks waiting in the deques */
+	size_t outstanding;			/* tasks queued or running */
+	int done;					/* no more files will be added */
+	int sleeping;
+	int walker_waiting;
+	pthread_t *io;
+	int nio;
+	struct write_batch *batches;
+	size_t nbatches;
+	struct ring full;			/* batches for the I/O threads */
+	struct ring empty;			/* batches for the decode workers */
+	uint64_t nwritten;			/* batches written */
+};
+
+/* live bytes per range task when a large file is split */
+#define EXTRACT_SPLIT (4 * 1024 * 1024)
+
+/* data per write batch, and batches per thread of the pipeline */
+#define BATCH_SIZE (256 * 1024)
+#define BATCHES_PER_THREAD 2
+
+/* files the tree walk may queue ahead of the decode workers */
+#define MAX_QUEUED_FILES 1024
+
+/* planning checks node CRCs and sets node flags, which must not race
+   when hard links queue the same inode twice */
+#define INODE_LOCKS 64
+
+static struct extract_pool pool;
+static pthread_mutex_t inode_locks[INODE_LOCKS];
+
+static void ring_init(struct ring *r, size_t capacity)
+{
+	size_t i, n = 1;
+
+	while (n < capacity)
+		n *= 2;
+	r->cells = xmalloc(n * sizeof(struct ring_cell));
+	for (i = 0; i < n; i++)
+		r->cells[i].seq = i;
+	r->mask = n - 1;
+	r->head = r->tail = 0;
+	r->waiters = r->closed = 0;
+	r->waits = 0;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+}
+
+/* adds a pointer to a ring, the caller guaranteeing that it fits */
+
+static void ring_push(struct ring *r, void *p)
+{
+	struct ring_cell *c;
+	size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	intptr_t dif;
+
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		dif = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			errmsg_die("bug: ring overflow");
+		else
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+	c->data = p;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in ring_pop: either the consumer sees the
+	   pointer, or this sees the consumer waiting */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->waiters, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+static void *ring_try_pop(struct ring *r)
+{
+	struct ring_cell *c;
+	size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	intptr_t dif;
+	void *p;
+
+	for (;;) {
+		c = &r->cells[pos & r->mask];
+		dif = (intptr_t) __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+	p = c->data;
+	__atomic_store_n(&c->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+	return p;
+}
+
+/* takes a pointer from a ring, sleeping while it is empty */
+
+/*
+   r       - ring
+
+   return value: the pointer, NULL once the ring is closed and empty
+ */
+
+static void *ring_pop(struct ring *r)
+{
+	void *p;
+
+	if ((p = ring_try_pop(r)))
+		return p;
+
+	pthread_mutex_lock(&r->lock);
+	__atomic_add_fetch(&r->waiters, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!(p = ring_try_pop(r)) && !r->closed) {
+		r->waits++;
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	__atomic_sub_fetch(&r->waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&r->lock);
+
+	return p;
+}
+
+/* wakes the consumers of a ring for good, once nothing is pushed */
+
+static void ring_close(struct ring *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->closed = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_free(struct ring *r)
+{
+	free(r->cells);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+}
+
+static void deque_push(struct task_deque *q, struct extract_task *t)
+{
+	struct extract_task *tasks;
+	size_t i;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count == q->alloc) {
+		tasks = xmalloc((q->alloc ? q->alloc * 2 : 64) * sizeof(*tasks));
+		for (i = 0; i < q->count; i++)
+			tasks[i] = q->tasks[(q->head + i) & (q->alloc - 1)];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->head = 0;
+		q->alloc = q->alloc ? q->alloc * 2 : 64;
+	}
+	q->tasks[(q->head + q->count++) & (q->alloc - 1)] = *t;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* takes a task from the tail (own deque) or the head (stealing) */
+
+static int deque_take(struct task_deque *q, struct extract_task *t, int steal)
+{
+	int got = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count) {
+		if (steal) {
+			*t = q->tasks[q->head];
+			q->head = (q->head + 1) & (q->alloc - 1);
+		} else
+			*t = q->tasks[(q->head + q->count - 1) & (q->alloc - 1)];
+		q->count--;
+		got = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return got;
+}
+
+/* queues a task on a worker's deque */
+
+/*
+   w       - worker
+   t       - task
+ */
+
+static void pool_push(struct extract_worker *w, struct extract_task *t)
+{
+	pthread_mutex_lock(&pool.lock);
+	pool.queued++;
+	pool.outstanding++;
+	pthread_mutex_unlock(&pool.lock);
+
+	deque_push(&w->q, t);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.sleeping)
+		pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* finds work for a worker, sleeping while there is none */
+
+/*
+   w       - worker
+   t       - result task
+
+   return value: 1 if a task was taken, 0 once all work is done
+ */
+
+static int pool_take(struct extract_worker *w, struct extract_task *t)
+{
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.queued && !(pool.done && !pool.outstanding)) {
+			pool.sleeping++;
+			pthread_cond_wait(&pool.cond, &pool.lock);
+			pool.sleeping--;
+		}
+		if (!pool.queued) {
+			pthread_mutex_unlock(&pool.lock);
+			return 0;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		if (deque_take(&w->q, t, 0))
+			goto got;
+		for (i = 1; i < pool.nworkers; i++)
+			if (deque_take(&pool.workers[(w->id + i) % pool.nworkers].q, t, 1))
+				goto got;
+
+		/* counted but not yet in its deque */
+		sched_yield();
+	}
+
+got:
+	pthread_mutex_lock(&pool.lock);
+	pool.queued--;
+	if (pool.walker_waiting && pool.queued < MAX_QUEUED_FILES)
+		pthread_cond_signal(&pool.space);
+	pthread_mutex_unlock(&pool.lock);
+	return 1;
+}
+
+static void pool_task_done(void)
+{
+	pthread_mutex_lock(&pool.lock);
+	if (!--pool.outstanding && pool.done)
+		pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* drops a reference to a job, taken by a range task or a batch, and
+   closes the file after the last one */
+
+/*
+   job     - file
+   end     - end of the data written under this reference
+   err     - errno of a failure, 0 on success
+ */
+
+static void job_release(struct extract_job *job, off_t end, int err)
+{
+	char *path;
+	int last;
+
+	pthread_mutex_lock(&pool.lock);
+	if (end > job->end)
+		job->end = end;
+	if (!job->err)
+		job->err = err;
+	last = !--job->pending;
+	pthread_mutex_unlock(&pool.lock);
+
+	if (!last)
+		return;
+
+	/* sets the size, which also creates any trailing hole */
+	if (!job->err && job->end != job->isize && ftruncate(job->fd, job->isize))
+		job->err = errno;
+	if (job->err) {
+		path = handle_path(job->dir, job->name);
+		warnmsg("Failed to write %s: %s", path, strerror(job->err));
+		free(path);
+	}
+	close(job->fd);
+	free(job->frags);
+	free(job);
+}
+
+/* hands the batch being filled to the I/O threads */
+
+static void flush_batch(struct batch_sink *out)
+{
+	struct write_batch *b = out->b;
+
+	if (!b)
+		return;
+	if (!b->nextents) {
+		/* nothing decoded into it was written */
+		b->used = 0;
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	out->job->pending++;
+	pthread_mutex_unlock(&pool.lock);
+
+	b->job = out->job;
+	out->b = NULL;
+	ring_push(&pool.full, b);
+}
+
+/* returns room for len bytes of decoded data in the batch being
+   filled, handing a full batch on first */
+
+static char *batch_buffer(struct file_sink *s, struct decoder *dc, size_t len)
+{
+	struct batch_sink *out = (struct batch_sink *) s;
+	struct write_batch *b;
+	char *p;
+
+	if (out->b && out->b->used + len > out->b->alloc)
+		flush_batch(out);
+	if (!out->b)
+		out->b = ring_pop(&pool.empty);
+
+	b = out->b;
+	if (len > b->alloc - b->used) {
+		/* a node larger than a batch, which is empty by now */
+		b->alloc = len;
+		b->buf = xrealloc(b->buf, b->alloc);
+	}
+	p = b->buf + b->used;
+	b->used += len;
+
+	return p;
+}
+
+/* adds data to the batch being filled */
+
+static int batch_write(struct file_sink *s, const char *data, size_t len, off_t ofs)
+{
+	struct batch_sink *out = (struct batch_sink *) s;
+	struct write_batch *b;
+	struct write_extent *e;
+
+	if (!out->b)
+		out->b = ring_pop(&pool.empty);
+
+	b = out->b;
+	if (b->nextents == b->extalloc) {
+		b->extalloc = b->extalloc ? b->extalloc * 2 : 64;
+		b->extents = xrealloc(b->extents, b->extalloc * sizeof(struct write_extent));
+	}
+	e = &b->extents[b->nextents++];
+	e->data = data;
+	e->len = len;
+	e->ofs = ofs;
+	b->bytes += len;
+	if (ofs + (off_t) len > b->end)
+		b->end = ofs + len;
+
+	/* data from the image does not pin the batch buffer, so a long
+	   run of uncompressed nodes can be handed on here */
+	if (b->bytes >= BATCH_SIZE && (data < b->buf || data >= b->buf + b->alloc))
+		flush_batch(out);
+
+	return 0;
+}
+
+/* writes a range of fragments of a job, directly or through batches
+   for the I/O threads, then drops the range's reference to the job */
+
+/*
+   w       - calling worker
+   job     - file
+   frags   - range of job fragments
+   nfrags  - number of fragments in the range
+ */
+
+static void write_range(struct extract_worker *w, struct extract_job *job,
+		const struct frag *frags, size_t nfrags)
+{
+	struct file_sink direct = { decoder_buffer, write_fd, job->fd, 0 };
+	int err = 0;
+
+	if (pool.nio) {
+		w->out.job = job;
+		write_frags(&w->dc, pool.o, job->ii, frags, nfrags, &w->out.s);
+		flush_batch(&w->out);
+	} else if (write_frags(&w->dc, pool.o, job->ii, frags, nfrags, &direct))
+		err = errno;
+
+	job_release(job, direct.end, err);
+}
+
+/* opens and plans a file, writing it whole or splitting it into range
+   tasks on the worker's own deque, from where idle workers steal them */
+
+static void run_file(struct extract_worker *w, struct extract_job *job)
+{
+	struct decoder *dc = &w->dc;
+	struct extract_task t;
+	pthread_mutex_t *lock = &inode_locks[job->ii->ino % INODE_LOCKS];
+	size_t i, from, nfrags;
+	uint64_t bytes;
+	char *path;
+	int dfd;
+
+	job->fd = -1;
+	if ((dfd = get_dirfd(job->dir)) >= 0) {
+		job->fd = openat(dfd, job->name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+		put_dirfd(job->dir);
+	}
+	if (job->fd < 0) {
+		path = handle_path(job->dir, job->name);
+		warnmsg("Failed to create %s: %s", path, strerror(errno));
+		free(path);
+		free(job);
+		return;
+	}
+
+	pthread_mutex_lock(lock);
+	nfrags = plan_file(dc, pool.o, job->ii, &job->isize);
+	pthread_mutex_unlock(lock);
+
+	for (i = 0, bytes = 0; i < nfrags; i++)
+		bytes += dc->frags[i].len;
+
+	if (bytes <= EXTRACT_SPLIT || pool.nworkers == 1) {
+		job->pending = 1;
+		write_range(w, job, dc->frags, nfrags);
+		return;
+	}
+
+	/* ranges end on node boundaries so each node is decoded once */
+	job->frags = xmalloc(nfrags * sizeof(struct frag));
+	memcpy(job->frags, dc->frags, nfrags * sizeof(struct frag));
+	job->nfrags = nfrags;
+	job->pending = 1;
+	t.job = job;
+	for (i = 0, from = 0, bytes = 0; i < nfrags; i++) {
+		bytes += job->frags[i].len;
+		if (i + 1 < nfrags && bytes >= EXTRACT_SPLIT &&
+				job->frags[i + 1].node != job->frags[i].node) {
+			pthread_mutex_lock(&pool.lock);
+			job->pending++;
+			pthread_mutex_unlock(&pool.lock);
+			t.from = from;
+			t.to = i + 1;
+			pool_push(w, &t);
+			from = i + 1;
+			bytes = 0;
+		}
+	}
+
+	/* the last range is written here, the others may be stolen */
+	write_range(w, job, job->frags + from, nfrags - from);
+}
+
+static void *extract_worker(void *arg)
+{
+	struct extract_worker *w = arg;
+	struct extract_task t;
+
+	while (pool_take(w, &t)) {
+		if (!t.job->frags)
+			run_file(w, t.job);
+		else
+			write_range(w, t.job, t.job->frags + t.from, t.to - t.from);
+		pool_task_done();
+	}
+
+	return NULL;
+}
+
+/* writes the batches decoded by the workers, and recycles them */
+
+static void *io_worker(void *arg)
+{
+	struct write_batch *b;
+	struct write_extent *e;
+	size_t i;
+	int err;
+
+	while ((b = ring_pop(&pool.full))) {
+		err = 0;
+		for (i = 0, e = b->extents; i < b->nextents && !err; i++, e++)
+			if (pwrite_all(b->job->fd, e->data, e->len, e->ofs))
+				err = errno;
+
+		job_release(b->job, b->end, err);
+		__atomic_add_fetch(&pool.nwritten, 1, __ATOMIC_RELAXED);
+
+		b->job = NULL;
+		b->used = b->nextents = b->bytes = 0;
+		b->end = 0;
+		ring_push(&pool.empty, b);
+	}
+
+	return NULL;
+}
+
+/* starts the extraction threads */
+
+/*
+   o        - filesystem image pointer
+   nthreads - number of decode threads
+   nio      - number of I/O threads, zero to write from the decode threads
+ */
+
+void start_pool(char *o, int nthreads, int nio)
+{
+	int i;
+	size_t k;
+
+	pool.o = o;
+	pool.nworkers = nthreads;
+	pool.workers = xzalloc(nthreads * sizeof(struct extract_worker));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pthread_cond_init(&pool.space, NULL);
+	for (i = 0; i < INODE_LOCKS; i++)
+		pthread_mutex_init(&inode_locks[i], NULL);
+
+	/* every worker holds at most one batch, so more batches than
+	   workers keep the I/O threads busy */
+	if (nio) {
+		pool.nio = nio;
+		pool.nbatches = BATCHES_PER_THREAD * (nthreads + nio);
+		pool.batches = xzalloc(pool.nbatches * sizeof(struct write_batch));
+		ring_init(&pool.full, pool.nbatches);
+		ring_init(&pool.empty, pool.nbatches);
+		for (k = 0; k < pool.nbatches; k++) {
+			pool.batches[k].alloc = BATCH_SIZE;
+			pool.batches[k].buf = xmalloc(BATCH_SIZE);
+			ring_push(&pool.empty, &pool.batches[k]);
+		}
+
+		pool.io = xmalloc(nio * sizeof(pthread_t));
+		for (i = 0; i < nio; i++)
+			if (pthread_create(&pool.io[i], NULL, io_worker, NULL))
+				errmsg_die("Unable to create I/O thread");
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pool.workers[i].id = i;
+		pool.workers[i].out.s.buffer = batch_buffer;
+		pool.workers[i].out.s.write = batch_write;
+		pthread_mutex_init(&pool.workers[i].q.lock, NULL);
+		if (pthread_create(&pool.workers[i].thread, NULL, extract_worker,
+				&pool.workers[i]))
+			errmsg_die("Unable to create extraction thread");
+	}
+}
+
+/* waits for all queued files, then stops the extraction threads and
+   adds their statistics to dc */
+
+/*
+   dc      - decoder receiving the statistics
+ */
+
+void finish_pool(struct decoder *dc)
+{
+	struct decoder *wdc;
+	size_t k;
+	int i, j;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.done = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.nworkers; i++) {
+		pthread_join(pool.workers[i].thread, NULL);
+		wdc = &pool.workers[i].dc;
+		for (j = 0; j <= JFFS2_COMPR_LZO; j++) {
+			dc->stats[j].nodes += wdc->stats[j].nodes;
+			dc->stats[j].bytes += wdc->stats[j].bytes;
+			dc->stats[j].ns += wdc->stats[j].ns;
+		}
+		dc->obsolete += wdc->obsolete;
+		dc->badcrc += wdc->badcrc;
+		free_decoder(wdc);
+		free(pool.workers[i].q.tasks);
+	}
+
+	if (pool.nio) {
+		ring_close(&pool.full);
+		for (i = 0; i < pool.nio; i++)
+			pthread_join(pool.io[i], NULL);
+
+		if (show_stats)
+			fprintf(stderr, "pipeline: %zu batches of %d KiB, %" PRIu64
+					" written, %" PRIu64 " waits for a free batch, %" PRIu64
+					" waits for data\n", pool.nbatches, BATCH_SIZE / 1024,
+					pool.nwritten, pool.empty.waits, pool.full.waits);
+
+		for (k = 0; k < pool.nbatches; k++) {
+			free(pool.batches[k].buf);
+			free(pool.batches[k].extents);
+		}
+		free(pool.batches);
+		ring_free(&pool.full);
+		ring_free(&pool.empty);
+		free(pool.io);
+	}
+
+	free(pool.workers);
+	memset(&pool, 0, sizeof(pool));
+}
+
+/* queues a file for extraction by the pool, waiting while the workers
+   are too far behind the tree walk */
+
+/*
+   dir     - directory to create the file in
+   name    - interned file name
+   ii      - nodes of the file
+ */
+
+static void queue_file(struct dir_handle *dir, const char *name,
+		struct inode_info *ii)
+{
+	struct extract_job *job;
+	struct extract_task t;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.queued >= MAX_QUEUED_FILES) {
+		pool.walker_waiting = 1;
+		pthread_cond_wait(&pool.space, &pool.lock);
+	}
+	pool.walker_waiting = 0;
+	pthread_mutex_unlock(&pool.lock);
+
+	job = xzalloc(sizeof(*job));
+	job->dir = dir;
+	job->name = name;
+	job->ii = ii;
+	t.job = job;
+	t.from = t.to = 0;
+
+	pool_push(&pool.workers[pool.next], &t);
+	pool.next = (pool.next + 1) % pool.nworkers;
+}
+
+/* larger files are written directly, not through the ring */
+#define URING_MAX_FILE (1024 * 1024)
+
+#ifdef HAVE_IO_URING
+
+/* orders write extents by file offset */
+
+static int cmp_extent(const void *a, const void *b)
+{
+	const struct write_extent *x = a, *y = b;
+
+	return x->ofs < y->ofs ? -1 : x->ofs > y->ofs;
+}
+
+/* buffer holding decoded data of a file in the ring */
+struct uring_buf {
+	struct uring_buf *next;
+	char data[];
+};
+
+/* file on its way through the ring. it is opened into a registered
+   file slot, written and closed by one chain of linked operations. */
+struct uring_file {
+	struct dir_handle *dir;		/* pinned until the open has run */
+	const char *name;			/* interned */
+	int slot;
+	int nops;					/* operations not completed */
+	int closed;
+	int err;
+	struct write_extent *extents;
+	size_t nextents, extalloc;
+	struct iovec *iov;
+	struct uring_buf *bufs;		/* newest first */
+	size_t used, alloc;			/* of the newest buffer */
+	size_t bufbytes;
+	uint64_t bytes, written;
+	off_t end;
+};
+
+/* where write_frags sends the data of a file in the ring */
+struct uring_sink {
+	struct file_sink s;
+	struct uring_file *f;
+};
+
+#define URING_ENTRIES 256		/* submission queue size */
+#define URING_SLOTS 256			/* files in flight */
+#define URING_MAX_IOV 1024		/* iovecs per writev */
+#define URING_MAX_BYTES (32 * 1024 * 1024)	/* decoded data in flight */
+#define URING_BUF_SIZE (64 * 1024)
+
+/* kinds of operations, in the low bits of user_data */
+#define URING_OPEN 0
+#define URING_WRITE 1
+#define URING_CLOSE 2
+
+static struct {
+	int fd;						/* -1 if not in use */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries, cq_entries;
+	unsigned queued;			/* filled, not yet submitted */
+	unsigned inflight;			/* submitted, not yet completed */
+	size_t bufbytes;			/* decoded data in flight */
+	int free_slots[URING_SLOTS];
+	int nfree;
+	uint64_t files, direct, ops, enters;
+} uring = { .fd = -1 };
+
+static int uring_enter(unsigned submit, unsigned wait)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, uring.fd, submit, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	uring.enters++;
+
+	return ret;
+}
+
+/* hands the queued operations to the kernel, optionally waiting for
+   one of them to complete */
+
+static void uring_submit(unsigned wait)
+{
+	int ret;
+
+	while (uring.queued || wait) {
+		ret = uring_enter(uring.queued, wait);
+		if (ret < 0)
+			sys_errmsg_die("io_uring_enter");
+		uring.queued -= ret;
+		uring.inflight += ret;
+		wait = 0;
+	}
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+	unsigned tail = *uring.sq_tail, i = tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[i] = i;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.queued++;
+	uring.ops++;
+
+	return sqe;
+}
+
+/* closes a registered file slot whose close operation did not run */
+
+static void uring_drop_slot(int slot)
+{
+	struct io_uring_files_update up;
+	int fd = -1;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (uintptr_t) &fd;
+	syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+static void uring_free_file(struct uring_file *f)
+{
+	struct uring_buf *b, *next;
+
+	for (b = f->bufs; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(f->extents);
+	free(f->iov);
+	free(f);
+}
+
+/* handles the completion of one operation, and of its file once its
+   last operation is done */
+
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+	struct uring_file *f = (struct uring_file *) (uintptr_t) (cqe->user_data & ~3ULL);
+	int kind = cqe->user_data & 3;
+	char *path;
+
+	uring.inflight--;
+
+	/* operations after a failure in the chain are cancelled */
+	if (cqe->res < 0 && cqe->res != -ECANCELED && !f->err)
+		f->err = -cqe->res;
+
+	if (kind == URING_OPEN)
+		put_dirfd(f->dir);
+	else if (kind == URING_WRITE && cqe->res > 0)
+		f->written += cqe->res;
+	else if (kind == URING_CLOSE && cqe->res == 0)
+		f->closed = 1;
+
+	if (--f->nops)
+		return;
+
+	if (!f->err && f->written != f->bytes)
+		f->err = EIO;
+	if (f->err) {
+		path = handle_path(f->dir, f->name);
+		warnmsg("Failed to write %s: %s", path, strerror(f->err));
+		free(path);
+	}
+	if (!f->closed)
+		uring_drop_slot(f->slot);
+	uring.free_slots[uring.nfree++] = f->slot;
+	uring.bufbytes -= f->bufbytes;
+	uring_free_file(f);
+}
+
+/* processes completed operations, waiting for at least one if wait */
+
+static void uring_reap(int wait)
+{
+	unsigned head, tail;
+
+	if (wait)
+		uring_submit(1);
+
+	head = *uring.cq_head;
+	tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		uring_complete(&uring.cqes[head & *uring.cq_mask]);
+		head++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* returns room for decoded data, in a buffer of the file in the ring */
+
+static char *uring_buffer(struct file_sink *s, struct decoder *dc, size_t len)
+{
+	struct uring_file *f = ((struct uring_sink *) s)->f;
+	struct uring_buf *b;
+	size_t size;
+
+	if (!f->bufs || f->used + len > f->alloc) {
+		size = len > URING_BUF_SIZE ? len : URING_BUF_SIZE;
+		b = xmalloc(sizeof(struct uring_buf) + size);
+		b->next = f->bufs;
+		f->bufs = b;
+		f->used = 0;
+		f->alloc = size;
+		f->bufbytes += size;
+	}
+	f->used += len;
+
+	return f->bufs->data + f->used - len;
+}
+
+/* records data of the file in the ring */
+
+static int uring_write(struct file_sink *s, const char *data, size_t len, off_t ofs)
+{
+	struct uring_file *f = ((struct uring_sink *) s)->f;
+	struct write_extent *e;
+
+	if (f->nextents == f->extalloc) {
+		f->extalloc = f->extalloc ? f->extalloc * 2 : 16;
+		f->extents = xrealloc(f->extents, f->extalloc * sizeof(struct write_extent));
+	}
+	e = &f->extents[f->nextents++];
+	e->data = data;
+	e->len = len;
+	e->ofs = ofs;
+	f->bytes += len;
+	if (ofs + (off_t) len > f->end)
+		f->end = ofs + len;
+
+	return 0;
+}
+
+/* writes the data of a file directly, for files the ring cannot
+   finish: the size of a file ending in a hole has to be set with
+   ftruncate, which is not an io_uring operation here */
+
+static int uring_put_direct(struct uring_file *f, int dfd, uint32_t isize)
+{
+	size_t i;
+	int fd;
+
+	uring.direct++;
+	fd = openat(dfd, f->name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < f->nextents; i++)
+		if (pwrite_all(fd, f->extents[i].data, f->extents[i].len, f->extents[i].ofs))
+			goto fail;
+	if (f->end != isize && ftruncate(fd, isize))
+		goto fail;
+
+	return close(fd);
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/* decodes a file and queues its open, writes and close as one chain.
+   contiguous data is written by one writev. */
+
+/*
+   dc      - decoder
+   o       - filesystem image pointer
+   ii      - nodes of the file
+   dir     - directory to create the file in
+   dfd     - its descriptor
+   name    - interned file name
+
+   return value: 0 if the file is queued or written, -1 with errno set
+   if it could not be created
+ */
+
+static int uring_put_file(struct decoder *dc, char *o, struct inode_info *ii,
+		struct dir_handle *dir, int dfd, const char *name)
+{
+	struct uring_sink out = { { uring_buffer, uring_write, -1, 0 }, NULL };
+	struct uring_file *f;
+	struct io_uring_sqe *sqe;
+	size_t i, j = 0, nfrags, nruns = 0;
+	uint32_t isize;
+	int ret = 0;
+
+	f = out.f = xzalloc(sizeof(*f));
+	f->dir = dir;
+	f->name = name;
+
+	nfrags = plan_file(dc, o, ii, &isize);
+	write_frags(dc, o, ii, dc->frags, nfrags, &out.s);
+
+	if (f->nextents) {
+		qsort(f->extents, f->nextents, sizeof(struct write_extent), cmp_extent);
+		f->iov = xmalloc(f->nextents * sizeof(struct iovec));
+		for (i = 0; i < f->nextents; i++) {
+			f->iov[i].iov_base = (void *) f->extents[i].data;
+			f->iov[i].iov_len = f->extents[i].len;
+			if (i == 0 || f->extents[i].ofs != f->extents[i - 1].ofs + f->extents[i - 1].len ||
+					i - j == URING_MAX_IOV)
+				nruns++, j = i;
+		}
+	}
+
+	if (f->end != isize || nruns + 2 > uring.sq_entries) {
+		if (uring_put_direct(f, dfd, isize))
+			ret = -1;
+		uring_free_file(f);
+		return ret;
+	}
+
+	/* room for the chain, its completions, a slot and its data */
+	uring.bufbytes += f->bufbytes;
+	while (!uring.nfree || uring.inflight + uring.queued + nruns + 2 > uring.cq_entries ||
+			(uring.bufbytes > URING_MAX_BYTES && uring.inflight + uring.queued))
+		uring_reap(1);
+	if (uring.sq_entries - uring.queued < nruns + 2)
+		uring_submit(0);
+
+	f->slot = uring.free_slots[--uring.nfree];
+	f->nops = nruns + 2;
+	uring.files++;
+	get_dirfd(dir);
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = dfd;
+	sqe->addr = (uintptr_t) name;
+	sqe->len = 0666;
+	/* direct descriptors are never inherited, and the kernel rejects
+	   O_CLOEXEC for them */
+	sqe->open_flags = O_WRONLY|O_CREAT|O_TRUNC;
+	sqe->file_index = f->slot + 1;
+	sqe->user_data = (uintptr_t) f | URING_OPEN;
+
+	for (i = 0; i < f->nextents; i = j) {
+		for (j = i + 1; j < f->nextents && j - i < URING_MAX_IOV &&
+				f->extents[j].ofs == f->extents[j - 1].ofs + f->extents[j - 1].len; j++)
+			;
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->fd = f->slot;
+		sqe->addr = (uintptr_t) &f->iov[i];
+		sqe->len = j - i;
+		sqe->off = f->extents[i].ofs;
+		sqe->user_data = (uintptr_t) f | URING_WRITE;
+	}
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = f->slot + 1;
+	sqe->user_data = (uintptr_t) f | URING_CLOSE;
+
+	if (uring.queued >= uring.sq_entries / 2)
+		uring_submit(0);
+	uring_reap(0);
+
+	return 0;
+}
+
+/* submits the queued operation and waits for its completion */
+
+/*
+   res     - result of the operation
+
+   return value: 0 on success, -1 if the ring failed
+ */
+
+static int uring_run_one(int *res)
+{
+	unsigned head;
+
+	uring_submit(0);
+	for (;;) {
+		head = *uring.cq_head;
+		if (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		if (uring_enter(0, 1) < 0)
+			return -1;
+	}
+	*res = uring.cqes[head & *uring.cq_mask].res;
+	__atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+	uring.inflight--;
+
+	return 0;
+}
+
+/* checks that opening into a registered slot and closing it works.
+   kernels before 5.15 ignore file_index and return a plain descriptor,
+   so only a result of zero means the open went into the slot, and the
+   slot is only closed once it is known to hold the file. */
+
+static int uring_selftest(void)
+{
+	struct io_uring_sqe *sqe;
+	int res;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uintptr_t) ".";
+	sqe->open_flags = O_RDONLY | O_DIRECTORY;
+	sqe->file_index = 1;
+	if (uring_run_one(&res))
+		return -1;
+	if (res > 0)
+		close(res);
+	if (res != 0)
+		return -1;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->file_index = 1;
+	if (uring_run_one(&res) || res < 0)
+		return -1;
+
+	uring.ops = 0;
+	uring.enters = 0;
+
+	return 0;
+}
+
+/* sets up the ring and its registered file slots */
+
+/*
+   return value: 0 on success, -1 if io_uring cannot be used here
+ */
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register reg;
+	struct io_uring_probe *probe;
+	static const int needed[] = { IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_CLOSE };
+	int fds[URING_SLOTS];
+	char *sq, *cq;
+	size_t i;
+
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring.fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	probe = xzalloc(sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		goto fail;
+	}
+	for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++)
+		if (needed[i] > probe->last_op ||
+				!(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+			free(probe);
+			goto fail;
+		}
+	free(probe);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = URING_SLOTS;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES2,
+			&reg, sizeof(reg)) < 0) {
+		for (i = 0; i < URING_SLOTS; i++)
+			fds[i] = -1;
+		if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES,
+				fds, URING_SLOTS) < 0)
+			goto fail;
+	}
+
+	uring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_size > uring.sq_ring_size)
+			uring.sq_ring_size = uring.cq_ring_size;
+		uring.cq_ring_size = 0;
+	}
+	uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ring == MAP_FAILED)
+		goto fail;
+	uring.cq_ring = uring.sq_ring;
+	if (uring.cq_ring_size) {
+		uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ring == MAP_FAILED)
+			goto unmap_sq;
+	}
+	uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd,
+			IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	sq = uring.sq_ring;
+	cq = uring.cq_ring;
+	uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	uring.sq_entries = p.sq_entries;
+	uring.cq_entries = p.cq_entries;
+
+	for (i = 0; i < URING_SLOTS; i++)
+		uring.free_slots[i] = URING_SLOTS - 1 - i;
+	uring.nfree = URING_SLOTS;
+
+	/* opening into a slot needs Linux 5.15, which the probe cannot tell */
+	if (uring_selftest())
+		goto unmap_sqes;
+
+	return 0;
+
+unmap_sqes:
+	munmap(uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+unmap_cq:
+	if (uring.cq_ring_size)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+unmap_sq:
+	munmap(uring.sq_ring, uring.sq_ring_size);
+fail:
+	close(uring.fd);
+	uring.fd = -1;
+	return -1;
+}
+
+/* waits for all files in the ring, then tears it down */
+
+static void uring_finish(void)
+{
+	if (uring.fd < 0)
+		return;
+
+	uring_submit(0);
+	while (uring.inflight)
+		uring_reap(1);
+
+	if (show_stats)
+		fprintf(stderr, "io_uring: %" PRIu64 " files, %" PRIu64 " operations in %"
+				PRIu64 " system calls, %" PRIu64 " files written directly\n",
+				uring.files, uring.ops, uring.enters, uring.direct);
+
+	munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+	if (uring.cq_ring_size)
+		munmap(uring.cq_ring, uring.cq_ring_size);
+	munmap(uring.sq_ring, uring.sq_ring_size);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+#else
+
+static struct {
+	int fd;
+} uring = { .fd = -1 };
+
+static int uring_init(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
 
-struct jffs2_raw_dirent *resolveinode(char *o, size_t size, uint32_t ino)
+static int uring_put_file(struct decoder *dc, char *o, struct inode_info *ii,
+		struct dir_handle *dir, int dfd, const char *name)
 {
-	return resolvedirent(o, size, ino, 0, NULL, 0);
+	return -1;
 }
 
-/* resolve slash-style path into dirent and inode.
-   slash as first byte marks absolute path (root=inode 1).
-   . and .. are resolved properly, and symlinks are followed.
- */
+static void uring_finish(void)
+{
+}
+
+#endif /* HAVE_IO_URING */
+
+/* creates a symbolic link, replacing whatever has its name */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - root inode, used if path is relative
-   p       - path to be resolved
-   inos    - result inode, zero if failure
-   recc    - recursion count, to detect symlink loops
+   target  - link target
+   dfd     - directory to create the link in
+   name    - link name
 
-   return value: pointer to dirent struct in file system image.
-   note that root directory doesn't have dirent struct
-   (return value is NULL), but it has inode (*inos=1)
+   return value: 0 on success, -1 with errno set on failure
  */
 
-struct jffs2_raw_dirent *resolvepath0(char *o, size_t size, uint32_t ino,
-		const char *p, uint32_t * inos, int recc)
+static int put_symlink(const char *target, int dfd, const char *name)
 {
-	struct jffs2_raw_dirent *dir = NULL;
+	int ret;
 
-	int d = 1;
-	uint32_t tino;
+	ret = symlinkat(target, dfd, name);
+	if (ret && errno == EEXIST && !unlinkat(dfd, name, 0))
+		ret = symlinkat(target, dfd, name);
 
-	char *next;
+	return ret;
+}
 
-	char *path, *pp;
+/* extracts a directory entry below the current directory. entries are
+   created relative to the descriptor of their directory. */
 
-	char symbuf[1024];
-	size_t symsize;
+/*
+   imagebuf  - filesystem image pointer
+   imagesize - size of filesystem image
+   pino      - inode of the directory of the entry
+   d         - entry
+   ii        - inode of the entry
+   path      - path of the directory of the entry
+ */
 
-	if (recc > 16) {
-		/* probably symlink loop */
-		*inos = 0;
-		return NULL;
+void do_extract(char* imagebuf, size_t imagesize, uint32_t pino, struct dir *d, char m, struct inode_info *ii, uint32_t size, const char *path, int verbose)
+{
+	struct dir_handle *dir = lookup_handle(pino, path);
+	char *fn, *target;
+	int dfd, fd, err = 0;
+
+	if (verbose && (d->type == DT_REG || d->type == DT_LNK))
+		printf("%s%s%s\n", (path[0] == 0) ? "" : path + 1,
+				(path[0] == 0) ? "" : "/", d->name);
+	if (d->type == DT_REG && pool.nworkers) {
+		queue_file(dir, d->name, ii);
+		return;
 	}
 
-	pp = path = strdup(p);
+	dfd = get_dirfd(dir);
+	if (dfd < 0) {
+		err = errno;
+		goto fail;
+	}
 
-	if (*path == '/') {
-		path++;
-		ino = 1;
+	switch (d->type) {
+		case DT_DIR:
+			if (mkdirat(dfd, d->name, 0777) && errno != EEXIST)
+				err = errno;
+			/* entries are looked for here even if it failed, and
+			   warned about one by one */
+			set_handle(d->ino, new_handle(dir, d->name));
+			break;
+		case DT_REG:
+			if (uring.fd >= 0 && ii->isize <= URING_MAX_FILE) {
+				if (uring_put_file(&dec, imagebuf, ii, dir, dfd, d->name))
+					err = errno;
+				break;
+			}
+			fd = openat(dfd, d->name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+			if (fd < 0) {
+				err = errno;
+				break;
+			}
+			if (putfile(&dec, imagebuf, ii, fd)) {
+				fn = handle_path(dir, d->name);
+				warnmsg("Failed to write %s: %s", fn, strerror(errno));
+				free(fn);
+			}
+			close(fd);
+			break;
+		case DT_LNK:
+			target = read_symlink(&dec, imagebuf, ii);
+			if (!target) {
+				fn = handle_path(dir, d->name);
+				warnmsg("No good node for symlink %s, not extracted", fn);
+				free(fn);
+			} else if (put_symlink(target, dfd, d->name))
+				err = errno;
+			free(target);
+			break;
+		default:
+			fn = handle_path(dir, d->name);
+			warnmsg("Not extracting special file %s", fn);
+			free(fn);
+			break;
 	}
+	put_dirfd(dir);
 
-	if (ino > 1) {
-		dir = resolveinode(o, size, ino);
+fail:
+	if (err) {
+		fn = handle_path(dir, d->name);
+		warnmsg("Failed to create %s: %s", fn, strerror(err));
+		free(fn);
+	}
+}
 
-		ino = DIRENT_INO(dir);
+/* archive written in place of extracting, in the POSIX pax format:
+   ustar headers, preceded by an extended header for names and link
+   targets too long for them. file data is decoded straight into the
+   archive. */
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)	/* the archive ends on a whole record */
+#define TAR_ZERO_SIZE (64 * 1024)
+#define TAR_OUT_SIZE (1024 * 1024)	/* stdio buffer of the archive */
+#define PAXTYPE 'x'					/* extended header of the next member */
+
+/* ustar header block */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+/* hash slot mapping an archived inode to its first name. later names
+   of the inode are archived as hard links to it. */
+struct tar_link {
+	uint32_t ino;
+	char *name;					/* NULL if the slot is free */
+};
+
+static struct {
+	FILE *fp;
+	struct tar_link *links;
+	size_t nslots, nused;		/* power of two */
+	uint64_t bytes, members;
+} tar;
+
+static const char tar_zeros[TAR_ZERO_SIZE];
+
+/* appends to the archive */
+
+static void tar_out(const void *data, size_t len)
+{
+	if (len && fwrite(data, 1, len, tar.fp) != len)
+		sys_errmsg_die("Unable to write archive");
+	tar.bytes += len;
+}
+
+static void tar_zero(uint64_t len)
+{
+	size_t n;
+
+	for (; len; len -= n) {
+		n = len < sizeof(tar_zeros) ? len : sizeof(tar_zeros);
+		tar_out(tar_zeros, n);
 	}
+}
 
-	next = path - 1;
+/* pads the archive to a whole block */
 
-	while (ino && next != NULL && next[1] != 0 && d) {
-		path = next + 1;
-		next = strchr(path, '/');
+static void tar_pad(void)
+{
+	tar_zero(-tar.bytes & (TAR_BLOCK - 1));
+}
 
-		if (next != NULL)
-			*next = 0;
+/* stores a number as zero padded octal filling a field but for its
+   terminating NUL */
 
-		if (*path == '.' && path[1] == 0)
-			continue;
-		if (*path == '.' && path[1] == '.' && path[2] == 0) {
-			if (DIRENT_PINO(dir) == 1) {
-				ino = 1;
-				dir = NULL;
-			} else {
-				dir = resolveinode(o, size, DIRENT_PINO(dir));
-				ino = DIRENT_INO(dir);
-			}
+static void tar_octal(char *field, size_t size, uint64_t val)
+{
+	size_t i;
 
-			continue;
-		}
+	field[size - 1] = '\0';
+	for (i = size - 1; i > 0; i--, val >>= 3)
+		field[i - 1] = '0' + (val & 7);
+}
 
-		dir = resolvename(o, size, ino, path, (uint8_t) strlen(path));
+/* stores a name in the name field, or split at a slash between the
+   prefix and name fields */
 
-		if (DIRENT_INO(dir) == 0 ||
-				(next != NULL &&
-				 !(dir->type == DT_DIR || dir->type == DT_LNK))) {
-			free(pp);
+/*
+   h       - header
+   name    - name in the archive
 
-			*inos = 0;
+   return value: 0 if it fits, -1 if it was cut short
+ */
 
-			return NULL;
+static int tar_name(struct tar_header *h, const char *name)
+{
+	size_t len = strlen(name), s;
+
+	if (len <= sizeof(h->name)) {
+		memcpy(h->name, name, len);
+		return 0;
+	}
+
+	/* the slash is implied, and the name part may not be empty */
+	for (s = len - sizeof(h->name) - 1; s <= sizeof(h->prefix) && s + 1 < len; s++)
+		if (s && name[s] == '/') {
+			memcpy(h->prefix, name, s);
+			memcpy(h->name, name + s + 1, len - s - 1);
+			return 0;
 		}
 
-		if (dir->type == DT_LNK) {
-			struct jffs2_raw_inode *ri;
-			ri = find_raw_inode(o, size, DIRENT_INO(dir), 0);
-			putblock(symbuf, sizeof(symbuf), &symsize, ri);
-			symbuf[symsize] = 0;
+	memcpy(h->name, name, sizeof(h->name));
+	return -1;
+}
 
-			tino = ino;
-			ino = 0;
+/* formats an extended header record, "<len> <key>=<value>\n" where len
+   counts the whole record including its own digits */
 
-			dir = resolvepath0(o, size, tino, symbuf, &ino, ++recc);
+/*
+   buf     - where to store the record, NULL to only measure it
 
-			if (dir != NULL && next != NULL &&
-					!(dir->type == DT_DIR || dir->type == DT_LNK)) {
-				free(pp);
+   return value: length of the record
+ */
 
-				*inos = 0;
-				return NULL;
-			}
-		}
-		if (dir != NULL)
-			ino = DIRENT_INO(dir);
-	}
+static size_t pax_record(char *buf, const char *key, const char *value)
+{
+	size_t base = strlen(key) + strlen(value) + 3, len = base + 1, n;
 
-	free(pp);
+	while ((n = base + snprintf(NULL, 0, "%zu", len)) != len)
+		len = n;
+	if (buf)
+		sprintf(buf, "%zu %s=%s\n", len, key, value);
 
-	*inos = ino;
+	return len;
+}
 
-	return dir;
+/* fills in the remaining fields and the checksum, and writes a header */
+
+static void tar_put_header(struct tar_header *h, char type, uint32_t mode,
+		uint32_t uid, uint32_t gid, uint64_t size, uint32_t mtime)
+{
+	const unsigned char *p = (const unsigned char *) h;
+	unsigned sum = 0;
+	size_t i;
+
+	tar_octal(h->mode, sizeof(h->mode), mode & 07777);
+	tar_octal(h->uid, sizeof(h->uid), uid);
+	tar_octal(h->gid, sizeof(h->gid), gid);
+	tar_octal(h->size, sizeof(h->size), size);
+	tar_octal(h->mtime, sizeof(h->mtime), mtime);
+	h->typeflag = type;
+	memcpy(h->magic, TMAGIC, TMAGLEN);
+	memcpy(h->version, TVERSION, TVERSLEN);
+
+	/* summed with the checksum field all spaces */
+	memset(h->chksum, ' ', sizeof(h->chksum));
+	for (i = 0; i < sizeof(*h); i++)
+		sum += p[i];
+	snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+
+	tar_out(h, sizeof(*h));
 }
 
-/* resolve slash-style path into dirent and inode.
-   slash as first byte marks absolute path (root=inode 1).
-   . and .. are resolved properly, and symlinks are followed.
- */
+/* writes the header of an archive member, after an extended header if
+   its name or link target does not fit */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   ino     - root inode, used if path is relative
-   p       - path to be resolved
-   inos    - result inode, zero if failure
-
-   return value: pointer to dirent struct in file system image.
-   note that root directory doesn't have dirent struct
-   (return value is NULL), but it has inode (*inos=1)
+   name    - name in the archive
+   type    - ustar type flag
+   ii      - inode of the member
+   size    - size of the data following the header
+   link    - link target, NULL for other types
  */
 
-struct jffs2_raw_dirent *resolvepath(char *o, size_t size, uint32_t ino,
-		const char *p, uint32_t * inos)
+static void tar_header(const char *name, char type, struct inode_info *ii,
+		uint32_t size, const char *link)
 {
-	return resolvepath0(o, size, ino, p, inos, 0);
+	struct tar_header h, x;
+	size_t len = 0;
+	char *pax;
+	int longname, longlink;
+
+	memset(&h, 0, sizeof(h));
+	longname = tar_name(&h, name);
+	longlink = link && strlen(link) > sizeof(h.linkname);
+	if (link)
+		strncpy(h.linkname, link, sizeof(h.linkname));
+	if (type == CHRTYPE || type == BLKTYPE) {
+		tar_octal(h.devmajor, sizeof(h.devmajor), major(ii->rdev));
+		tar_octal(h.devminor, sizeof(h.devminor), minor(ii->rdev));
+	}
+
+	if (longname || longlink) {
+		if (longname)
+			len += pax_record(NULL, "path", name);
+		if (longlink)
+			len += pax_record(NULL, "linkpath", link);
+		pax = xmalloc(len + 1);
+		len = 0;
+		if (longname)
+			len += pax_record(pax + len, "path", name);
+		if (longlink)
+			len += pax_record(pax + len, "linkpath", link);
+
+		memset(&x, 0, sizeof(x));
+		tar_name(&x, "././@PaxHeader");
+		tar_put_header(&x, PAXTYPE, 0644, 0, 0, len, ii->mtime);
+		tar_out(pax, len);
+		tar_pad();
+		free(pax);
+	}
+
+	tar_put_header(&h, type, ii->mode, ii->uid, ii->gid, size, ii->mtime);
+	tar.members++;
 }
 
-/* lists files on directory specified by path */
+/* appends data of the file being archived. fragments arrive in file
+   order, so a gap before one is a hole or a zero node. */
+
+static int tar_write(struct file_sink *s, const char *data, size_t len, off_t ofs)
+{
+	tar_zero(ofs - s->end);
+	tar_out(data, len);
+	s->end = ofs + len;
+
+	return 0;
+}
+
+/* archives a regular file. the size is known before any data is
+   decoded, so the header goes first and every node is decoded into the
+   archive as its fragments come up in file order. */
 
 /*
+   dc      - decoder
    o       - filesystem image pointer
-   size    - size of filesystem image
-   p       - path to be resolved
+   ii      - nodes of the file
+   name    - name in the archive
  */
 
-void visit(char *o, size_t size, const char *path, int verbose, visitor visitor)
+static void tar_file(struct decoder *dc, char *o, struct inode_info *ii,
+		const char *name)
 {
-	struct jffs2_raw_dirent *dd;
-	struct dir *d = NULL;
+	struct file_sink out = { decoder_buffer, tar_write, -1, 0 };
+	size_t nfrags;
+	uint32_t isize;
+
+	nfrags = plan_file(dc, o, ii, &isize);
+	if (nfrags)
+		qsort(dc->frags, nfrags, sizeof(struct frag), cmp_frag_ofs);
+
+	tar_header(name, REGTYPE, ii, isize, NULL);
+	write_frags(dc, o, ii, dc->frags, nfrags, &out);
+	tar_zero(isize - out.end);
+	tar_pad();
+}
 
-	uint32_t ino;
-	dd = resolvepath(o, size, 1, path ? path : "/", &ino);
+/* finds the slot of an inode in the link hash, making room for it */
 
-	if (ino == 0 ||
-			(dd == NULL && ino == 0) || (dd != NULL && dd->type != DT_DIR))
-		errmsg_die("%s: No such file or directory", path ? path : "/");
+static struct tar_link *tar_link(uint32_t ino)
+{
+	struct tar_link *old = tar.links;
+	size_t i, h, nold = tar.nslots;
+
+	if (2 * (tar.nused + 1) > tar.nslots) {
+		tar.nslots = nold ? nold * 2 : 256;
+		tar.links = xzalloc(tar.nslots * sizeof(struct tar_link));
+		for (i = 0; i < nold; i++)
+			if (old[i].name)
+				*tar_link(old[i].ino) = old[i];
+		free(old);
+	}
 
-	d = collectdir(o, size, ino, d);
-	visitdir(o, size, d, path, verbose, visitor);
-	freedir(d);
+	for (h = (ino * 0x9e3779b1) & (tar.nslots - 1);
+			tar.links[h].name && tar.links[h].ino != ino;
+			h = (h + 1) & (tar.nslots - 1))
+		;
+
+	return &tar.links[h];
 }
 
-/* writes file specified by path to the buffer */
+/* archives a directory entry */
 
 /*
-   o       - filesystem image pointer
-   size    - size of filesystem image
-   p       - path to be resolved
-   b       - file buffer
-   bsize   - file buffer size
-   rsize   - file result size
- */
-
-void do_extract(char* imagebuf, size_t imagesize, struct dir *d, char m, struct jffs2_raw_inode *ri, uint32_t size, const char *path, int verbose)
-{
-    char fnbuf[4096];
-    int fd = -1;
-    size_t sz = 0;
-    snprintf(fnbuf, sizeof(fnbuf), "%s%s%s", (path[0] == 0) ? "" : path+1, (path[0] == 0) ? "" : "/", d->name);
-    switch(m) {
-        case '/':
-            if(mkdir(fnbuf, 0777) && errno != EEXIST) {
-                warnmsg("Failed to create %s: %s", fnbuf, strerror(errno));
-            }
-            break;
-        case ' ':
-            if(verbose) printf("%s\n", fnbuf);
-            fd = open(fnbuf, O_WRONLY|O_CREAT, 0666);
-            if(fd < 0) {
-                warnmsg("Failed to create %s: %s", fnbuf, strerror(errno));
-            } else {
-                while(ri) {
-                    char buf[16384];
-                    putblock(buf, sizeof(buf), &sz, ri);
-                    write(fd, buf, sz);
-                    ri = find_raw_inode(imagebuf, imagesize, d->ino, je32_to_cpu(ri->version));
-                }
-            }
-            break;
-        default:
-            warnmsg("Not extracting special file %s", fnbuf);
-            break;
-    }
+   imagebuf  - filesystem image pointer
+   imagesize - size of filesystem image
+   pino      - inode of the directory of the entry
+   d         - entry
+   ii        - inode of the entry
+   path      - path of the directory of the entry
+ */
+
+void do_tar(char* imagebuf, size_t imagesize, uint32_t pino, struct dir *d, char m, struct inode_info *ii, uint32_t size, const char *path, int verbose)
+{
+	struct tar_link *l = NULL;
+	char *name, *target = NULL;
+
+	name = xmalloc(strlen(path) + d->nsize + 3);
+	sprintf(name, "%s%s%s%s", (path[0] == 0) ? "" : path + 1,
+			(path[0] == 0) ? "" : "/", d->name, d->type == DT_DIR ? "/" : "");
+
+	if (d->type == DT_SOCK || (d->type != DT_DIR && d->type != DT_REG &&
+			d->type != DT_LNK && d->type != DT_CHR && d->type != DT_BLK &&
+			d->type != DT_FIFO)) {
+		warnmsg("Not archiving special file %s", name);
+		free(name);
+		return;
+	}
+	/* verbose output stays out of an archive written to stdout */
+	if (verbose)
+		fprintf(tar.fp == stdout ? stderr : stdout, "%s\n", name);
+
+	/* a directory has one name, anything else may have several */
+	if (d->type != DT_DIR) {
+		l = tar_link(d->ino);
+		if (l->name) {
+			tar_header(name, LNKTYPE, ii, 0, l->name);
+			free(name);
+			return;
+		}
+		/* a link that cannot be archived is not linked to either */
+		if (d->type == DT_LNK && !(target = read_symlink(&dec, imagebuf, ii))) {
+			warnmsg("No good node for symlink %s, not archived", name);
+			free(name);
+			return;
+		}
+		l->ino = d->ino;
+		l->name = name;
+		tar.nused++;
+	}
+
+	switch (d->type) {
+		case DT_DIR:
+			tar_header(name, DIRTYPE, ii, 0, NULL);
+			break;
+		case DT_REG:
+			tar_file(&dec, imagebuf, ii, name);
+			break;
+		case DT_LNK:
+			tar_header(name, SYMTYPE, ii, 0, target);
+			free(target);
+			break;
+		case DT_CHR:
+			tar_header(name, CHRTYPE, ii, 0, NULL);
+			break;
+		case DT_BLK:
+			tar_header(name, BLKTYPE, ii, 0, NULL);
+			break;
+		case DT_FIFO:
+			tar_header(name, FIFOTYPE, ii, 0, NULL);
+			break;
+	}
+
+	if (!l)
+		free(name);
+}
+
+/* opens the archive, "-" for stdout */
+
+static void tar_open(const char *file)
+{
+	if (strcmp(file, "-") == 0)
+		tar.fp = stdout;
+	else if (!(tar.fp = fopen(file, "wb")))
+		sys_errmsg_die("%s", file);
+
+	if (isatty(fileno(tar.fp)))
+		errmsg_die("Refusing to write archive to a terminal");
+	setvbuf(tar.fp, NULL, _IOFBF, TAR_OUT_SIZE);
+}
+
+/* ends the archive with two zero blocks, padded to a whole record */
+
+static void tar_close(void)
+{
+	size_t i;
+
+	tar_zero(2 * TAR_BLOCK);
+	tar_zero(-tar.bytes % TAR_RECORD);
+	if (fflush(tar.fp) || (tar.fp != stdout && fclose(tar.fp)))
+		sys_errmsg_die("Unable to write archive");
+
+	for (i = 0; i < tar.nslots; i++)
+		free(tar.links[i].name);
+	free(tar.links);
+}
+
+/* prints index statistics to stderr */
+
+void print_index_stats(size_t size)
+{
+	uint64_t erased = 0;
+	size_t i;
+
+	for (i = 0; i < idx.nerased; i++)
+		erased += idx.erased[i].len;
+
+	fprintf(stderr, "image: %zu bytes, %s endian, %zu inode nodes, %zu dirent nodes\n",
+			size, target_endian == __BIG_ENDIAN ? "big" : "little",
+			idx.ninodes, idx.ndirents);
+	fprintf(stderr, "erased: %" PRIu64 " bytes (%.1f%%) in %zu extents\n",
+			erased, size ? 100.0 * erased / size : 0.0, idx.nerased);
+	if (idx.erasesize)
+		fprintf(stderr, "erase blocks: %zu of %lu bytes, %zu read from summary\n",
+				idx.nblocks, idx.erasesize, idx.nsumblocks);
+	if (idx.nbadcrc)
+		fprintf(stderr, "bad crc: %zu nodes ignored\n", idx.nbadcrc);
+	fprintf(stderr, "tree: %zu directories, %zu entries, %zu names, %zu KiB\n",
+			tree.ndirs, tree.nentries, tree.nnames, tree.used / 1024);
+}
+
+/* prints decompression statistics to stderr */
+
+void print_stats(struct decoder *dc)
+{
+	static const char *names[JFFS2_COMPR_LZO + 1] = {
+		"none", "zero", "rtime", "rubinmips", "copy", "dynrubin", "zlib", "lzo"
+	};
+	struct decode_stats *st;
+	int i;
+
+	fprintf(stderr, "%-10s %10s %14s %10s %10s\n",
+			"method", "nodes", "bytes", "ms", "MiB/s");
+	for (i = 0; i <= JFFS2_COMPR_LZO; i++) {
+		st = &dc->stats[i];
+		if (!st->nodes)
+			continue;
+		fprintf(stderr, "%-10s %10" PRIu64 " %14" PRIu64 " %10.1f %10.1f\n",
+				names[i], st->nodes, st->bytes, st->ns / 1e6,
+				st->ns ? st->bytes / (1024.0 * 1024.0) / (st->ns / 1e9) : 0.0);
+	}
+	fprintf(stderr, "%-10s %10" PRIu64 "\n", "obsolete", dc->obsolete);
+	if (dc->badcrc)
+		fprintf(stderr, "%-10s %10" PRIu64 "\n", "bad crc", dc->badcrc);
 }
 
 void usage(char** argv) {
-    fprintf(stderr, "Usage: %s {-t | -x} [-f imagefile] [-C path] [-v] [file1 [file2 ...]]\n", argv[0]);
+    fprintf(stderr, "Usage: %s {-t | -x | --to-tar archive | -O tar} [-f imagefile] [-C path] [-v] [-e erasesize] [-j threads] [--io-threads n] [--io-uring] [--stats] [--no-summary] [file1 [file2 ...]]\n", argv[0]);
     exit(255);
 }
 
-/* usage example */
-#define BUFFER_SIZE 16384
+enum {
+	OPT_STATS = 256,
+	OPT_NO_SUMMARY,
+	OPT_IO_THREADS,
+	OPT_IO_URING,
+	OPT_TO_TAR
+};
+
+static const struct option long_options[] = {
+	{ "stats", no_argument, NULL, OPT_STATS },
+	{ "no-summary", no_argument, NULL, OPT_NO_SUMMARY },
+	{ "io-threads", required_argument, NULL, OPT_IO_THREADS },
+	{ "io-uring", no_argument, NULL, OPT_IO_URING },
+	{ "to-tar", required_argument, NULL, OPT_TO_TAR },
+	{ NULL, 0, NULL, 0 }
+};
+
+#define BUFFER_SIZE (1024*1024)
+
+/* loads the filesystem image. regular files are mapped, anything else
+   (pipes, stdin) is read into a buffer that grows geometrically. */
+
+/*
+   fd      - image file descriptor
+   size    - result image size
+   mapped  - result flag, set if the image is mapped
+
+   return value: pointer to the image
+ */
+
+char *load_image(int fd, size_t *size, int *mapped)
+{
+	struct stat st;
+	size_t alloc = BUFFER_SIZE;
+	ssize_t bytes;
+	char *buf;
+
+	*size = 0;
+	*mapped = 0;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			madvise(buf, st.st_size, MADV_SEQUENTIAL);
+			*size = st.st_size;
+			*mapped = 1;
+			return buf;
+		}
+	}
+
+	/* presize from fstat, one extra byte to see EOF without regrowing */
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		alloc = st.st_size + 1;
+
+	buf = xmalloc(alloc);
+	while ((bytes = read(fd, buf + *size, alloc - *size)) != 0) {
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			sys_errmsg_die("Unable to read image");
+		}
+		*size += bytes;
+		if (*size == alloc)
+			buf = xrealloc(buf, alloc *= 2);
+	}
+
+	return buf;
+}
+
+/* releases an image returned by load_image */
+
+void unload_image(char *buf, size_t size, int mapped)
+{
+	if (mapped)
+		munmap(buf, size);
+	else
+		free(buf);
+}
+
 int main(int argc, char **argv)
 {
-	int fd, opt, want_ctime = 0, verbose = 0;
-	size_t filesize, bytes;
+	int fd, opt, mapped, verbose = 0, nthreads = 1, nio = 0, err = 0;
+	int use_uring = 0;
+	unsigned long erasesize = 0;
+	char *end;
+	size_t filesize;
     visitor v = NULL;
-	char *scratch, *imgfile = NULL;
-	size_t ssize = 0;
+	char *imgfile = NULL;
+	const char *tarfile = NULL;
 
 	char *buf;
 	
@@ -866,7 +4337,7 @@ int main(int argc, char **argv)
 	    usage(argv);
 	}
 
-	while ((opt = getopt(argc, argv, "hf:C:txv")) > 0) {
+	while ((opt = getopt_long(argc, argv, "hf:C:txvO:e:j:", long_options, NULL)) > 0) {
 		switch (opt) {
 		    case 'h':
 		        usage(argv);
@@ -880,14 +4351,56 @@ int main(int argc, char **argv)
 			    }
 			    break;
 			case 't':
-			    if(v) errmsg_die("Can't specify both -x and -t");
+			    if(v) errmsg_die("Can't specify more than one of -x, -t, --to-tar");
 			    v = do_print;
 				break;
 			case 'v':
 			    verbose = 1;
 				break;
+			case 'O':
+				if (strcmp(optarg, "tar"))
+					errmsg_die("Unknown output format: %s", optarg);
+				if (v)
+					errmsg_die("Can't specify more than one of -x, -t, --to-tar");
+				v = do_tar;
+				tarfile = "-";
+				break;
+			case OPT_TO_TAR:
+				if (v)
+					errmsg_die("Can't specify more than one of -x, -t, --to-tar");
+				v = do_tar;
+				tarfile = optarg;
+				break;
+			case OPT_STATS:
+				show_stats = 1;
+				break;
+			case OPT_NO_SUMMARY:
+				use_summary = 0;
+				break;
+			case OPT_IO_URING:
+				use_uring = 1;
+				break;
+			case OPT_IO_THREADS:
+				nio = simple_strtoul(optarg, &err);
+				if (err || nio < 0)
+					errmsg_die("Invalid number of I/O threads: %s", optarg);
+				break;
+			case 'e':
+				erasesize = strtoul(optarg, &end, 0);
+				if (*end == 'k' || *end == 'K')
+					erasesize *= 1024, end++;
+				else if (*end == 'm' || *end == 'M')
+					erasesize *= 1024 * 1024, end++;
+				if (*end || !is_power_of_2(erasesize) || erasesize < 4096)
+					errmsg_die("Invalid erase block size: %s", optarg);
+				break;
+			case 'j':
+				nthreads = simple_strtoul(optarg, &err);
+				if (err || nthreads < 1)
+					errmsg_die("Invalid number of threads: %s", optarg);
+				break;
 			case 'x':
-			    if(v) errmsg_die("Can't specify both -x and -t");
+			    if(v) errmsg_die("Can't specify more than one of -x, -t, --to-tar");
 			    v = do_extract;
 			    break;
 			default:
@@ -898,20 +4411,32 @@ int main(int argc, char **argv)
 		}
 	}
 	
-	if(!v) errmsg_die("Must specify one of -x, -t");
+	if(!v) errmsg_die("Must specify one of -x, -t, --to-tar");
+	if (v == do_tar)
+		tar_open(tarfile);
+
+	crc32_init();
+	if (lzo_init() != LZO_E_OK)
+		errmsg_die("Unable to initialise LZO");
 
     if(imgfile) {
         fd = open(imgfile, O_RDONLY);
         if (fd == -1)
-            sys_errmsg_die("%s", argv[optind]);
+            sys_errmsg_die("%s", imgfile);
     } else fd = STDIN_FILENO;
     
-    buf = xmalloc(BUFFER_SIZE);
-    while((bytes = read(fd, buf + filesize, BUFFER_SIZE)) == BUFFER_SIZE) {
-        filesize += bytes;
-        buf = xrealloc(buf, filesize + BUFFER_SIZE);
-    }
-    filesize += bytes;
+    buf = load_image(fd, &filesize, &mapped);
+
+    target_endian = detect_endian(buf, filesize);
+    build_index(buf, filesize, nthreads, erasesize);
+    if (mapped)
+        madvise(buf, filesize, MADV_RANDOM);
+    /* the ring takes the place of the extraction threads, -j still
+       sets the scan threads */
+    if (v == do_extract && use_uring && uring_init())
+        warnmsg("io_uring is not available, writing files directly");
+    if (v == do_extract && (nthreads > 1 || nio) && uring.fd < 0)
+        start_pool(buf, nthreads, nio);
 
     if (argc > optind) {
         int i;
@@ -924,7 +4449,27 @@ int main(int argc, char **argv)
     } else {
         visit(buf, filesize, NULL, verbose, v);
     }
+	if (pool.nworkers)
+		finish_pool(&dec);
+	uring_finish();
+	if (v == do_tar)
+		tar_close();
+
+	if (show_stats) {
+		print_index_stats(filesize);
+		print_stats(&dec);
+		if (v == do_extract)
+			fprintf(stderr, "directories: %" PRIu64 " opened, %" PRIu64 " reused\n",
+					handles.opens, handles.hits);
+		if (v == do_tar)
+			fprintf(stderr, "archive: %" PRIu64 " members, %" PRIu64 " bytes\n",
+					tar.members, tar.bytes);
+	}
+	if (v == do_extract)
+		free_handles();
 
-	free(buf);
+	free_decoder(&dec);
+	free_index();
+	unload_image(buf, filesize, mapped);
 	exit(EXIT_SUCCESS);
 }